@@ -21,7 +21,7 @@
 """binarization tools."""
 
 from gamera.plugin import PluginFunction, PluginModule
-from gamera.args import Args, ImageType, Int, Real, FloatVector
+from gamera.args import Args, ImageType, Int, Real, FloatVector, Class, String
 from gamera.enums import ONEBIT, GREYSCALE, GREY16, FLOAT
 
 from gamera.gui import has_gui
@@ -38,15 +38,23 @@ class wiener2_filter(PluginFunction):
 
     *noise_variancee*
       noise variance. If negative, estimated automatically.
+
+    *noise_sample*
+      when the noise variance is estimated, only every noise_sample-th
+      pixel of every noise_sample-th row is used. 1 uses all the pixels.
+
+    The image is filtered row by row, so little memory is needed besides
+    the output image.
     """
     return_type = ImageType([GREYSCALE, GREY16, FLOAT], "output")
     self_type = ImageType([GREYSCALE, GREY16, FLOAT])
     args = Args([Int("region_width", default=5),
          Int("region_height", default=5),
-         Real("noise_variance", default=-1.0)])
+         Real("noise_variance", default=-1.0),
+         Int("noise_sample", default=1)])
 
-    def __call__(self, region_width=5, region_height=5, noise_variance=-1.0):
-        return _background_estimation.wiener2_filter(self, region_width, region_height, noise_variance)
+    def __call__(self, region_width=5, region_height=5, noise_variance=-1.0, noise_sample=1):
+        return _background_estimation.wiener2_filter(self, region_width, region_height, noise_variance, noise_sample)
     __call__ = staticmethod(__call__)
 
 
@@ -57,13 +65,42 @@ class background_estimation(PluginFunction):
     *med_size*
         the kernel for median filter.
         the default value works best for image with size 1000*1000 to 2000*2000
+
+    *pyramid_levels*
+        if positive, the background is estimated on the image reduced
+        pyramid_levels times by half, with a proportionally smaller kernel,
+        and enlarged back bilinearly. This is much faster for large kernels;
+        use *background_estimation_error* to check the difference.
+
+    GREY16 images are estimated at 16 bits.
     """
-    return_type = ImageType([GREYSCALE], "output")
-    self_type = ImageType([GREYSCALE])
-    args = Args([Int("med_size", default=17)])
+    return_type = ImageType([GREYSCALE, GREY16], "output")
+    self_type = ImageType([GREYSCALE, GREY16])
+    args = Args([Int("med_size", default=17),
+                 Int("pyramid_levels", default=0)])
+
+    def __call__(self, med_size=17, pyramid_levels=0):
+        return _background_estimation.background_estimation(self, med_size, pyramid_levels)
+    __call__ = staticmethod(__call__)
+
+
+class background_estimation_error(PluginFunction):
+    """
+    Compares the background estimated with *pyramid_levels* reduction
+    levels with the full-resolution background, to choose the number of
+    levels for a collection.
+
+    Returns the mean absolute difference, the root mean square difference,
+    the largest absolute difference and the fraction of pixels that differ
+    by more than 4 grey levels.
+    """
+    return_type = FloatVector("error")
+    self_type = ImageType([GREYSCALE, GREY16])
+    args = Args([Int("med_size", default=17),
+                 Int("pyramid_levels", default=2)])
 
-    def __call__(self, med_size=17):
-        return _background_estimation.background_estimation(self, med_size)
+    def __call__(self, med_size=17, pyramid_levels=2):
+        return _background_estimation.background_estimation_error(self, med_size, pyramid_levels)
     __call__ = staticmethod(__call__)
 
 
@@ -108,9 +145,12 @@ class equalise_histogram_mask(PluginFunction):
     """
      Normalises the histogram of the given image to match an input
      histogram within mask region
+
+     GREY16 images are equalised over all 65536 levels, the reference
+     histogram is stretched to that range.
   """
-    return_type = ImageType([GREYSCALE], "output")
-    self_type = ImageType([GREYSCALE])
+    return_type = ImageType([GREYSCALE, GREY16], "output")
+    self_type = ImageType([GREYSCALE, GREY16])
     args = Args([ImageType([ONEBIT], "mask"),
          FloatVector("reference_histogram")])
 
@@ -200,9 +240,13 @@ class binarization(PluginFunction):
     the default values for wiener and median filtrs works best for image with size 1000*1000 to 2000*2000
     Use the default settings for the other parameters unless you know
     what you are doing.
+
+    GREY16 images are binarized at 16 bits throughout, and FLOAT images
+    are stretched to 16 bits first. The Sauvola bounds and dynamic range
+    are given in 8-bit levels and scaled to the depth of the image.
     """
     return_type = ImageType([ONEBIT], "output")
-    self_type = ImageType([GREYSCALE])
+    self_type = ImageType([GREYSCALE, GREY16, FLOAT])
     args = Args([ImageType([ONEBIT], "mask"),
                  FloatVector("reference_histogram"),
          Int("do_wiener", default=0),
@@ -232,17 +276,216 @@ class binarization(PluginFunction):
     __call__ = staticmethod(__call__)
 
 
+class binarization_with_accounting(PluginFunction):
+    """
+    Binarizes the image like *binarization*, and records the memory
+    allocated by each stage of the binarization. Returns the tuple
+    (output, accounting).
+
+    *accounting*
+      a dict with the page size ("ncols", "nrows"), the bytes allocated for
+      images, the number of allocations and the high-water mark of the
+      bytes held ("bytes", "allocations", "peak"), and the same for each
+      stage under "stages", in the order the stages ran.
+
+    *json_file*
+      if not empty, the accounting is also appended to this file as one
+      line of JSON, so a batch leaves one line per page.
+    """
+    return_type = Class("result")
+    self_type = ImageType([GREYSCALE, GREY16, FLOAT])
+    args = Args([ImageType([ONEBIT], "mask"),
+                 FloatVector("reference_histogram"),
+         Int("do_wiener", default=0),
+         Int("wiener_width", default=5),
+         Int("wiener_height", default=3),
+         Real("noise_variance", default=-1.0),
+                 Int("med_size", default=17),
+         Int("region size", default=15),
+                 Real("sensitivity", default=0.5),
+                 Int("dynamic range", range=(1, 255), default=128),
+                 Int("lower bound", range=(0, 255), default=20),
+                 Int("upper bound", range=(0, 255), default=150),
+                 Real("q", default=0.06),
+                 Real("p1", default=0.7),
+                 Real("p2", default=0.5),
+                 String("json_file", default="")])
+
+    def __call__(self, mask, reference_histogram,
+         do_wiener=0, wiener_width=5, wiener_height=3, noise_variance=-1.0,
+         med_size=17,
+         region_size=15, sensitivity=0.5, dynamic_range=128, lower_bound=20, upper_bound=150,
+         q=0.06, p1=0.7, p2=0.5,
+         json_file=""):
+        return _background_estimation.binarization_with_accounting(self, mask, reference_histogram,
+                        do_wiener, wiener_width, wiener_height, noise_variance,
+                        med_size, region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                        q, p1, p2, json_file)
+
+    __call__ = staticmethod(__call__)
+
+
+class create_binarization_context(PluginFunction):
+    """
+    Prepares binarization for a series of pages, typically the pages of a
+    book, that are binarized with the same reference histogram and
+    parameters. The context keeps the cumulative reference histogram, the
+    working buffers and the worker threads from one page to the next.
+
+    The arguments are those of *binarization*, plus:
+
+    *pyramid_levels*
+      reduction levels for background estimation, see *background_estimation*
+
+    *tile_size*
+      if positive, pages are binarized in tiles of about this many pixels
+      square, with the same result as the whole page at once (0). Tiles
+      need *pyramid_levels* of at least 1. Besides the output, only the
+      buffers of a tile and the page reduced by the pyramid levels, on
+      which the background is estimated, are kept, so the memory is about
+      that of a few reduced pages: each level divides it by four. A page
+      too small for a pyramid level is binarized at once.
+
+    *threads*
+      number of threads, 0 for one per processor core
+
+    *page_width*, *page_height*
+      if given, the buffers are prepared for pages of this size
+
+    Use *BinarizationContext* rather than calling this directly.
+    """
+    self_type = None
+    return_type = Class("context")
+    args = Args([FloatVector("reference_histogram"),
+         Int("do_wiener", default=0),
+         Int("wiener_width", default=5),
+         Int("wiener_height", default=3),
+         Real("noise_variance", default=-1.0),
+                 Int("med_size", default=17),
+                 Int("pyramid_levels", default=0),
+                 Int("tile_size", default=0),
+         Int("region size", default=15),
+                 Real("sensitivity", default=0.5),
+                 Int("dynamic range", range=(1, 255), default=128),
+                 Int("lower bound", range=(0, 255), default=20),
+                 Int("upper bound", range=(0, 255), default=150),
+                 Real("q", default=0.06),
+                 Real("p1", default=0.7),
+                 Real("p2", default=0.5),
+                 Int("threads", default=0),
+                 Int("page_width", default=0),
+                 Int("page_height", default=0)])
+
+    def __call__(reference_histogram,
+         do_wiener=0, wiener_width=5, wiener_height=3, noise_variance=-1.0,
+         med_size=17, pyramid_levels=0, tile_size=0,
+         region_size=15, sensitivity=0.5, dynamic_range=128, lower_bound=20, upper_bound=150,
+         q=0.06, p1=0.7, p2=0.5,
+         threads=0, page_width=0, page_height=0):
+        return _background_estimation.create_binarization_context(reference_histogram,
+                        do_wiener, wiener_width, wiener_height, noise_variance,
+                        med_size, pyramid_levels, tile_size,
+                        region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                        q, p1, p2,
+                        threads, page_width, page_height)
+    __call__ = staticmethod(__call__)
+
+
+class binarization_in_context(PluginFunction):
+    """
+    Binarizes the image within *mask* like *binarization*, with the
+    reference histogram and parameters of *context*, made by
+    *create_binarization_context*.
+    """
+    return_type = ImageType([ONEBIT], "output")
+    self_type = ImageType([GREYSCALE, GREY16, FLOAT])
+    args = Args([ImageType([ONEBIT], "mask"),
+                 Class("context")])
+
+    def __call__(self, mask, context):
+        return _background_estimation.binarization_in_context(self, mask, context)
+    __call__ = staticmethod(__call__)
+
+
+class binarization_in_context_with_accounting(PluginFunction):
+    """
+    Binarizes the image like *binarization_in_context*, and records the
+    memory allocated by each stage of the binarization. Returns the tuple
+    (output, accounting).
+
+    *accounting*
+      a dict with the page size ("ncols", "nrows"), the bytes allocated for
+      images, the number of allocations and the high-water mark of the
+      bytes held ("bytes", "allocations", "peak"), and the same for each
+      stage under "stages", in the order the stages ran. The buffers the
+      context kept from the previous page count towards the high-water
+      marks.
+
+    *json_file*
+      if not empty, the accounting is also appended to this file as one
+      line of JSON, so a batch leaves one line per page.
+    """
+    return_type = Class("result")
+    self_type = ImageType([GREYSCALE, GREY16, FLOAT])
+    args = Args([ImageType([ONEBIT], "mask"),
+                 Class("context"),
+                 String("json_file", default="")])
+
+    def __call__(self, mask, context, json_file=""):
+        return _background_estimation.binarization_in_context_with_accounting(self, mask, context, json_file)
+    __call__ = staticmethod(__call__)
+
+
+class BinarizationContext(object):
+    """
+    Binarizes many pages with one set of parameters. The arguments are
+    those of *create_binarization_context*; the pages are then binarized
+    by calling the context::
+
+      context = BinarizationContext(sample_hist, med_size=17)
+      for image, mask in pages:
+          output = context(image, mask)
+    """
+    def __init__(self, reference_histogram,
+         do_wiener=0, wiener_width=5, wiener_height=3, noise_variance=-1.0,
+         med_size=17, pyramid_levels=0, tile_size=0,
+         region_size=15, sensitivity=0.5, dynamic_range=128, lower_bound=20, upper_bound=150,
+         q=0.06, p1=0.7, p2=0.5,
+         threads=0, page_width=0, page_height=0):
+        self.context = _background_estimation.create_binarization_context(reference_histogram,
+                        do_wiener, wiener_width, wiener_height, noise_variance,
+                        med_size, pyramid_levels, tile_size,
+                        region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                        q, p1, p2,
+                        threads, page_width, page_height)
+
+    def __call__(self, image, mask):
+        return _background_estimation.binarization_in_context(image, mask, self.context)
+
+    def with_accounting(self, image, mask, json_file=""):
+        """Binarizes the page and returns (output, accounting), see
+        *binarization_in_context_with_accounting*."""
+        return _background_estimation.binarization_in_context_with_accounting(image, mask, self.context, json_file)
+
+
 class BackgroundEstimationGenerator(PluginModule):
     category = "Background Estimation"
     cpp_headers = ["background_estimation.hpp"]
+    extra_compile_args = ["-pthread"]
+    extra_link_args = ["-pthread"]
     functions = [wiener2_filter,
          background_estimation,
+         background_estimation_error,
          optimal_histogram,
          histogram_mask,
          equalise_histogram_mask,
          mask_fill,
          gatos_threshold_mask,
-         binarization]
+         binarization,
+         binarization_with_accounting,
+         create_binarization_context,
+         binarization_in_context,
+         binarization_in_context_with_accounting]
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
     url = "http://ddmal.music.mcgill.ca/"
 
@@ -2,10 +2,16 @@
 #ifndef ypo21082008_background_estimation
 #define ypo21082008_background_estimation
 
+#include "gameramodule.hpp"
 #include "gamera.hpp"
 #include "plugins/image_utilities.hpp"
 #include "plugins/binarization.hpp"
 #include "border_removal.hpp"
+#include "local_statistics.hpp"
+#include "masked_view.hpp"
+#include "parallel.hpp"
+#include "resample.hpp"
+#include "memory_accounting.hpp"
 
 #include "math.h"
 #include <vector>
@@ -18,262 +24,544 @@ using namespace Gamera;
 using namespace std;
 
 
+// ===================== Pixel Range =======================
+/* the largest pixel value of the greyscale types of the binarization
+   pipeline. 8-bit and 16-bit images use their whole range; the other types
+   are kept in the 8-bit range, as they always have been.
+ */
+template<class T>
+struct pixel_range
+{
+    static double top() { return 255.0; }
+};
+
+template<>
+struct pixel_range<Grey16Pixel>
+{
+    static double top() { return 65535.0; }
+};
+
+
 // ===================== Wiener Filter =======================
+/* this function adds up the local variances of the pixels of [x0, x1) x
+   [y0, y1) in "src" that are on every noise_sample-th row and column, for
+   the noise variance estimate of "wiener2_filter_core". The local windows
+   are those of the whole of "src", so a region of a larger image gives the
+   same variances as the image itself if "src" extends far enough around it.
+ */
+template<class T>
+void wiener_noise_sum(const T &src, size_t region_width, size_t region_height, size_t noise_sample,
+                      size_t x0, size_t y0, size_t x1, size_t y1,
+                      double &sum, size_t &samples)
+{
+  size_t half_region_width = region_width / 2;
+  size_t half_region_height = region_height / 2;
+  rolling_window<T> window(src, half_region_height);
+  for (size_t y = 0; y < y1; ++y) {
+    bool sampled=(y>=y0) && (y%noise_sample==0);
+    window.next_row(sampled);
+    if (!sampled)
+      continue;
+    for (size_t x = x0 + (noise_sample - x0 % noise_sample) % noise_sample; x < x1; x+=noise_sample) {
+      coord_t wx0, wy0, wx1, wy1;
+      local_window(x, y, half_region_width, half_region_height, src.ncols(), src.nrows(), wx0, wy0, wx1, wy1);
+
+      double mean_patch, variance_patch;
+      window.mean_variance(wx0, wx1, mean_patch, variance_patch);
+      sum += variance_patch;
+      samples++;
+    }
+  }
+}
+
+
 /* this function implement the 2D adaptive noise-removal filter (directional).
  * the way to deal with the case when the local variance is smaller than the noise variance might be wrong. Further checking is needed.
  * The implementation of region size is not entirely correct because of
    integer rounding but matches the implementation of the thresholding
    algorithms.
+ * the image is streamed row by row: local mean and variance come from a
+   "rolling_window" (see local_statistics.hpp), once to estimate the noise
+   variance and once more while filtering, so besides the output only a few
+   rows of sums are kept.
 
     *region_width*, *region_height*
       The size of the region within which to calculate the intermediate pixel value.
 
   *noise_variancee*
     noise variance. If negative, estimated automatically.
+
+  *noise_sample*
+    the noise variance is estimated from every noise_sample-th pixel of every
+    noise_sample-th row. 1 uses all the pixels.
  */
-template<class T>
-typename ImageFactory<T>::view_type* wiener2_filter(const T &src, size_t region_width, size_t region_height, double noise_variance0)
+template<class T, class V>
+void wiener2_filter_core(const T &src, V &view, size_t region_width, size_t region_height, double noise_variance0,
+                         size_t noise_sample = 1)
 {
     if ((min(region_width, region_height) < 1) || (max(region_width, region_height) > std::min(src.nrows(), src.ncols())))
         throw std::out_of_range("wiener_filter: region_size out of range");
+    if (noise_sample < 1)
+        throw std::out_of_range("wiener_filter: noise_sample must be at least 1");
 
     size_t half_region_width = region_width / 2;
     size_t half_region_height = region_height / 2;
-
-    typename ImageFactory<T>::view_type* patch = ImageFactory<T>::new_view(src);
-    typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
-    typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
-
-  vector<double> mean(src.nrows()*src.ncols()); // local mean vector
-  vector<double> variance(src.nrows()*src.ncols()); // local variance vector
   double noise_variance=0;
+  double top=pixel_range<typename V::value_type>::top();
   coord_t x,y;
 
-    for (y = 0; y < src.nrows(); ++y) {
-        for (x = 0; x < src.ncols(); ++x) {
-            // Define the region.
-            Point ul((coord_t)std::max(0, (int)x - (int)half_region_width),
-                     (coord_t)std::max(0, (int)y - (int)half_region_height));
-            Point lr((coord_t)std::min(x + half_region_width, src.ncols() - 1),
-                     (coord_t)std::min(y + half_region_height, src.nrows() - 1));
-            patch->rect_set(ul, lr);
-
-      double mean_patch=0;
-      double variance_patch=0;
-      unsigned int m, n;
-      // compute local mean
-      for (m=0; m<patch->nrows(); m++) {
-        for (n=0; n<patch->ncols(); n++) {
-          mean_patch += patch->get(Point(n, m));
-        }
-      }
-      mean_patch=mean_patch/(patch->nrows()*patch->ncols());
-      // compute local variance
-      for (m=0; m<patch->nrows(); m++) {
-        for (n=0; n<patch->ncols(); n++) {
-          variance_patch += (patch->get(Point(n, m))-mean_patch)*(patch->get(Point(n, m))-mean_patch);
-        }
-      }
-      variance_patch=variance_patch/(patch->nrows()*patch->ncols()-1);
-
-      mean[y*src.ncols()+x]=mean_patch;
-      variance[y*src.ncols()+x]=variance_patch;
-      noise_variance += variance_patch;
-        }
-    }
   if (noise_variance0>0)
     noise_variance=noise_variance0;
   // compute noise variance
-  else
-    noise_variance=noise_variance/(src.nrows()*src.ncols());
+  else {
+    size_t samples=0;
+    wiener_noise_sum(src, region_width, region_height, noise_sample,
+                     0, 0, src.ncols(), src.nrows(), noise_variance, samples);
+    noise_variance=noise_variance/samples;
+  }
 
   // filtering
-    for (y = 0; y < src.nrows(); ++y) {
-        for (x = 0; x < src.ncols(); ++x) {
-      double value=mean[y*src.ncols()+x]+max(0.0, variance[y*src.ncols()+x]-noise_variance)/variance[y*src.ncols()+x]*(src.get(Point(x, y))-mean[y*src.ncols()+x]);
-      if (value>255)
-        value=255;
+  rolling_window<T> window(src, half_region_height);
+  typename T::const_row_iterator src_row = src.row_begin();
+  typename V::row_iterator out_row = view.row_begin();
+    for (y = 0; y < src.nrows(); ++y, ++src_row, ++out_row) {
+      window.next_row();
+      typename T::const_row_iterator::iterator src_col = src_row.begin();
+      typename V::row_iterator::iterator out_col = out_row.begin();
+        for (x = 0; x < src.ncols(); ++x, ++src_col, ++out_col) {
+      coord_t x0, y0, x1, y1;
+      local_window(x, y, half_region_width, half_region_height, src.ncols(), src.nrows(), x0, y0, x1, y1);
+
+      double mean_patch, variance_patch;
+      window.mean_variance(x0, x1, mean_patch, variance_patch);
+      double value=mean_patch+max(0.0, variance_patch-noise_variance)/variance_patch*(*src_col-mean_patch);
+      if (value>top)
+        value=top;
       else if (value<0)
         value=0;
-      view->set(Point(x, y), value);
+      *out_col = value;
     }
   }
+}
+
 
-    delete patch;
+template<class T>
+typename ImageFactory<T>::view_type* wiener2_filter(const T &src, size_t region_width, size_t region_height, double noise_variance0,
+                                                    int noise_sample = 1)
+{
+    typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
+    typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
+    try {
+      if (noise_sample < 1)
+        throw std::out_of_range("wiener_filter: noise_sample must be at least 1");
+      wiener2_filter_core(src, *view, region_width, region_height, noise_variance0, noise_sample);
+    } catch (std::exception e) {
+      delete view;
+      delete data;
+      throw;
+    }
     return view;
 }
 
 
 // ==================== Background Estimation =======================
+/* this function stretches the pixel values linearly to the full range of
+   the pixel type (0-255 or 0-65535), in the same way "to_greyscale"
+   converts a FLOAT image. The median used to go through a FLOAT image, so
+   this keeps the 8-bit background unchanged.
+ */
+template<class T>
+void stretch_greyscale(T &src)
+{
+  typedef typename T::value_type value_type;
+  value_type min_value=*min_element(src.vec_begin(), src.vec_end());
+  value_type max_value=*max_element(src.vec_begin(), src.vec_end());
+  double scale=(max_value-min_value>0) ? pixel_range<value_type>::top()/(max_value-min_value) : 0.0;
+  vector<value_type> table((size_t)max_value+1, 0);
+  for (size_t value=min_value; value<=max_value; value++)
+    table[value]=(value_type)((value-min_value)*scale);
+  for (typename T::vec_iterator it=src.vec_begin(); it!=src.vec_end(); it++)
+    *it=table[*it];
+}
+
+
 /* this function estimates background of image by median filter and flood fill.
+ * the median is computed by the sliding histogram filter of median_filter.hpp.
+ * GREYSCALE and GREY16 images are estimated at their own depth, and the
+   background has the pixel type of the image.
 
   *med_size*
     the kernel for median filter.
+
+ * the filling holes step runs on "pool".
  */
 template<class T>
-GreyScaleImageView* background_estimation(const T &src, size_t med_size)
+typename ImageFactory<T>::view_type* background_estimation(const T &src, size_t med_size, thread_pool &pool)
 {
+  typedef typename ImageFactory<T>::view_type view_type;
+
   // median filter
-  FloatImageView* image_med_float=med_filter(src, med_size);
-  GreyScaleImageView* image_med=to_greyscale(*image_med_float);
+  view_type* image_med=account_image(median_filter(src, med_size));
+  stretch_greyscale(*image_med);
 
   // filling holes
-  GreyScaleImageView* image_med_pad=pad_image(*image_med, 1, 1, 1, 1, 0);
-  GreyScaleImageView* image_fill_pad=flood_fill_holes_grey(*image_med_pad);
+  view_type* image_med_pad=account_image(pad_image(*image_med, 1, 1, 1, 1, 0));
+  view_type* image_fill_pad=flood_fill_holes_grey(*image_med_pad, 4, pool);
   image_fill_pad->rect_set(Point(1, 1), src.size());
-  GreyScaleImageView* result=simple_image_copy(*image_fill_pad);
+  view_type* result=account_image(simple_image_copy(*image_fill_pad));
   result->move(-1, -1);
   (result->data())->page_offset_x(0);
   (result->data())->page_offset_y(0);
 
-  delete image_med_float->data();
-  delete image_med_float;
-  delete image_med->data();
-  delete image_med;
-  delete image_med_pad->data();
-  delete image_med_pad;
-  delete image_fill_pad->data();
-  delete image_fill_pad;
+  release_image(image_med);
+  release_image(image_med_pad);
+  release_image(image_fill_pad);
 
   return result;
 }
 
 
+template<class T>
+typename ImageFactory<T>::view_type* background_estimation(const T &src, size_t med_size)
+{
+  thread_pool pool(1);
+  return background_estimation(src, med_size, pool);
+}
+
+
+/* multi-resolution version of background estimation.
+ * the image is reduced by 2^pyramid_levels (block means), the background is
+   estimated at that scale with a median kernel reduced by the same factor,
+   and enlarged back bilinearly. The background is smooth, so little is lost
+   while the median and the flood fill work on a fraction of the pixels.
+   Levels that would reduce the image below the kernel are not used; 0
+   levels is the full-resolution estimation.
+ * "pyramid_factor" is the reduction factor used for an image of
+   ncols x nrows.
+ */
+inline size_t pyramid_factor(size_t ncols, size_t nrows, size_t med_size, int pyramid_levels)
+{
+  size_t factor=1;
+  for (int level=0; level<pyramid_levels; level++) {
+    size_t reduced_size=std::min(nrows, ncols)/(2*factor);
+    if ((reduced_size<1) || (std::max((size_t)1, med_size/(2*factor))>reduced_size))
+      break;
+    factor*=2;
+  }
+  return factor;
+}
+
+
+/* the background estimated on "src" reduced by "factor", as chosen by
+   "pyramid_factor".
+ */
+template<class T>
+typename ImageFactory<T>::view_type* background_estimation_reduced(const T &src, size_t med_size, size_t factor,
+                                                                   thread_pool &pool)
+{
+  typedef typename ImageFactory<T>::view_type view_type;
+
+  if (factor==1)
+    return background_estimation(src, med_size, pool);
+
+  view_type* reduced=account_image(reduce_mean(src, factor));
+  view_type* reduced_background=NULL;
+  view_type* result=NULL;
+  try {
+    reduced_background=background_estimation(*reduced, std::max((size_t)1, med_size/factor), pool);
+    result=account_image(expand_bilinear(*reduced_background, factor, Dim(src.ncols(), src.nrows())));
+  } catch (std::exception e) {
+    release_image(reduced);
+    release_image(reduced_background);
+    throw;
+  }
+
+  release_image(reduced);
+  release_image(reduced_background);
+  return result;
+}
+
+
+template<class T>
+typename ImageFactory<T>::view_type* background_estimation(const T &src, size_t med_size, int pyramid_levels,
+                                                           thread_pool &pool)
+{
+  return background_estimation_reduced(src, med_size, pyramid_factor(src.ncols(), src.nrows(), med_size, pyramid_levels), pool);
+}
+
+
+template<class T>
+typename ImageFactory<T>::view_type* background_estimation(const T &src, size_t med_size, int pyramid_levels)
+{
+  thread_pool pool(1);
+  return background_estimation(src, med_size, pyramid_levels, pool);
+}
+
+
+/* this function compares the multi-resolution background with the
+   full-resolution one, to choose the number of levels for a collection.
+   It returns the mean absolute difference, the root mean square
+   difference, the largest absolute difference and the fraction of pixels
+   that differ by more than 4 levels.
+ */
+template<class T>
+FloatVector* background_estimation_error(const T &src, size_t med_size, int pyramid_levels)
+{
+  typedef typename ImageFactory<T>::view_type view_type;
+
+  view_type* full=background_estimation(src, med_size);
+  view_type* reduced=background_estimation(src, med_size, pyramid_levels);
+
+  double sum=0, sum_squares=0, largest=0;
+  size_t far=0;
+  typename view_type::vec_iterator f=full->vec_begin();
+  typename view_type::vec_iterator r=reduced->vec_begin();
+  for ( ; f!=full->vec_end(); f++, r++) {
+    double difference=fabs((double)*f-(double)*r);
+    sum+=difference;
+    sum_squares+=difference*difference;
+    largest=max(largest, difference);
+    if (difference>4)
+      far++;
+  }
+  double n=(double)(src.nrows()*src.ncols());
+
+  FloatVector* report=new FloatVector(4);
+  (*report)[0]=sum/n;
+  (*report)[1]=sqrt(sum_squares/n);
+  (*report)[2]=largest;
+  (*report)[3]=far/n;
+
+  release_image(full);
+  release_image(reduced);
+  return report;
+}
+
+
 // ======================= Histogram Equalization ====================
 // --------------- Histogram with Mask -------------
+/* number of histogram bins of a pixel type. GREY16 pixels are stored in a
+   wider integer, so their histogram has 65536 bins rather than one bin per
+   value of the storage type; larger values count in the last bin.
+ */
+template<class T>
+struct histogram_levels {};
+
+template<>
+struct histogram_levels<GreyScalePixel>
+{
+    enum { levels = 256 };
+};
+
+template<>
+struct histogram_levels<Grey16Pixel>
+{
+    enum { levels = 65536 };
+};
+
+
+/* this function counts the pixel values of the rows [begin, end) of
+   "image" where "mask" is 1 into "counts", which has one bin per level,
+   and returns the number of pixels counted.
+ * the mask is read row by row alongside the image, and the count is added
+   unconditionally (0 or 1), so the inner loop has no branch.
+ */
+template<class T, class U>
+size_t histogram_mask_rows(const T& image, const U& mask, size_t begin, size_t end,
+                           vector<unsigned int> &counts)
+{
+    size_t last = counts.size() - 1;
+    size_t size = 0;
+
+    typename T::const_row_iterator row = advance_rows(image.row_begin(), begin);
+    typename U::const_row_iterator mask_row = advance_rows(mask.row_begin(), begin);
+    for (size_t y = begin; y < end; y++, ++row, ++mask_row) {
+        typename T::const_row_iterator::iterator col = row.begin();
+        typename U::const_row_iterator::iterator mask_col = mask_row.begin();
+        for ( ; col != row.end(); ++col, ++mask_col) {
+            unsigned int inside = (*mask_col == 1);
+            counts[std::min((size_t)*col, last)] += inside;
+            size += inside;
+        }
+    }
+    return size;
+}
+
+
 /* this function colculates histogram of an image within the region indicated by mask image.
+ * row blocks are counted in parallel on "pool", each into its own integer
+   histogram, and the histograms are added up at the end.
  */
 template<class T, class U>
-FloatVector* histogram_mask(const T& image, const U& mask) {
-// The histogram is the size of all of the possible values of
-// the pixel type.
-    size_t l = std::numeric_limits<typename T::value_type>::max() + 1;
-    FloatVector* values = new FloatVector(l);
-  double size = 0;
+FloatVector* histogram_mask(const T& image, const U& mask, thread_pool &pool) {
+    if (image.size() != mask.size())
+        throw std::invalid_argument("histogram_mask: sizes must match");
+
+    // The histogram is the size of all of the possible values of
+    // the pixel type.
+    size_t l = histogram_levels<typename T::value_type>::levels;
+    FloatVector* values = new FloatVector(l, 0.0);
 
     try {
-      // set the list to 0
-      std::fill(values->begin(), values->end(), 0);
-
-      typename T::const_row_iterator row = image.row_begin();
-      typename T::const_col_iterator col;
-      ImageAccessor<typename T::value_type> acc;
-
-    coord_t m=0;
-    coord_t n=0;
-
-      // create the histogram
-      for (; row != image.row_end(); ++row) {
-    n=0;
-      for (col = row.begin(); col != row.end(); ++col) {
-      if (mask.get(Point(n,m))==1) {
-        size=size+1.0;
-        (*values)[acc.get(col)]++;
-      }
-      n++;
-    }
-    m++;
-  }
+        size_t nrows = image.nrows();
+        size_t blocks = std::min(pool.size(), nrows);
+        vector<vector<unsigned int> > counts(blocks);
+        vector<size_t> sizes(blocks, 0);
+        pool.run(blocks, [&](size_t i) {
+            size_t begin, end;
+            block_range(nrows, blocks, i, begin, end);
+            counts[i].assign(l, 0);
+            sizes[i] = histogram_mask_rows(image, mask, begin, end, counts[i]);
+        });
+
+        double size = 0;
+        for (size_t i = 0; i < blocks; i++) {
+            size += sizes[i];
+            for (size_t k = 0; k < l; k++)
+                (*values)[k] += counts[i][k];
+        }
 
-      // convert from absolute values to percentages
-      for (size_t i = 0; i < l; i++) {
-  (*values)[i] = (*values)[i] / size;
-      }
+        // convert from absolute values to percentages
+        for (size_t k = 0; k < l; k++)
+            (*values)[k] = (*values)[k] / size;
     } catch (std::exception e) {
-      delete values;
-      throw;
+        delete values;
+        throw;
     }
 
     return values;
 }
 
 
+template<class T, class U>
+FloatVector* histogram_mask(const T& image, const U& mask) {
+    thread_pool pool(1);
+    return histogram_mask(image, mask, pool);
+}
+
+
 // --------- Image equalise_histogram with Mask----------------
 
 /* Equalise an image histogram to match a reference histogram.
+ * for every input level, the output level is the first one whose
+   cumulative count reaches the input cumulative count (less a tolerance);
+   if it overshoots by the whole pixel count, level 0 is used as in MATLAB.
+ * cumulative histograms are non-decreasing, so the matching output level
+   moves forward with the input level and both histograms are walked once
+   (two pointers), instead of scanning the output histogram for every input
+   level. The pointer may also step back, which keeps the result exact when
+   rounding makes consecutive targets decrease slightly.
+ * a reference with fewer levels than the input (256 levels for a GREY16
+   page) is stretched so that its top level maps to the top input level.
  */
-template<class T, class U>
-class find_transform
-     : public std::binary_function<T, T, U>
-   {
-     const std::vector<T> output_cumulative_histogram;
-     const T pixel_count;
-     const double input_length;
-
-   public:
-
-     find_transform(const std::vector<T> &output_cumulative_histogram,
-                    unsigned int pixel_count,
-                    unsigned int input_length)
-       : output_cumulative_histogram(output_cumulative_histogram),
-         pixel_count(pixel_count),
-         input_length(input_length) {}
-     U operator()(T in, T tol)
-       {
-       FloatVector differences(output_cumulative_histogram.size());
-       std::transform(output_cumulative_histogram.begin(),
-                      output_cumulative_histogram.end(),
-                      differences.begin(),
-                      std::bind1st(std::plus<T>(), (T)(tol - in)));
-       std::replace_if(differences.begin(), differences.end(),
-                       std::bind2nd(std::less<T>(), (T)0), // cf. MATLAB
-                       pixel_count);
-       return (U)((double)(std::min_element(differences.begin(),
-                                            differences.end())
-                           - differences.begin())
-                  * (input_length /
-                     (double)output_cumulative_histogram.size()));
-       }
-   };
+template<class V>
+void match_histogram(const FloatVector &input_cumulative_histogram,
+                     const FloatVector &tolerance,
+                     const FloatVector &output_cumulative_histogram,
+                     unsigned int pixel_count,
+                     std::vector<V> &value_transform)
+{
+     typedef typename FloatVector::value_type Float;
+
+     size_t input_length = input_cumulative_histogram.size();
+     size_t output_length = output_cumulative_histogram.size();
+     double scale = (output_length > 1) ? (double)(input_length - 1) / (double)(output_length - 1) : 0.0;
+
+     value_transform.resize(input_length);
+     size_t out = 0;
+     for (size_t in = 0; in < input_length; in++) {
+       Float offset = (Float)(tolerance[in] - input_cumulative_histogram[in]);
+       while ((out > 0) && (offset + output_cumulative_histogram[out - 1] >= 0))
+         out--;
+       while ((out < output_length) && !(offset + output_cumulative_histogram[out] >= 0))
+         out++;
+
+       size_t level = 0;
+       if ((out < output_length) && (offset + output_cumulative_histogram[out] < (Float)pixel_count))
+         level = out;
+       value_transform[in] = (V)((double)level * scale);
+     }
+}
 
 
-template<class T, class U>
-Image* equalise_histogram_mask(const T& image, const U& mask,
-              const FloatVector *hist)
+/* cumulative reference histogram, normalised to sum to the pixel count of
+   a page. It only depends on the page through its pixel count, so it is
+   computed once and reused as long as the pages have the same size.
+ */
+class reference_histogram
 {
-     typedef typename ImageFactory<T>::data_type data_type;
-     typedef typename ImageFactory<T>::view_type view_type;
-     typedef typename FloatVector::value_type Float;
+public:
+    explicit reference_histogram(const FloatVector &histogram)
+        : m_histogram(histogram), m_pixel_count(0) {}
 
-     // Prepare the output image.
+    const FloatVector &histogram() const { return m_histogram; }
 
-     data_type* output_data = new data_type(image);
-     view_type* output_image = new view_type(*output_data);
+    const FloatVector &cumulative(unsigned int pixel_count)
+    {
+        typedef FloatVector::value_type Float;
 
-     // Define histograms for input and (ideal) output.
+        if (m_cumulative.empty() || (pixel_count != m_pixel_count)) {
+            // Normalise histogram to sum to total number of pixels in image.
 
-     FloatVector *input_histogram = histogram_mask(image, mask);
-     FloatVector output_histogram(*hist);
+            FloatVector output_histogram(m_histogram);
+            std::transform(output_histogram.begin(), output_histogram.end(),
+                           output_histogram.begin(),
+                           std::bind1st(std::multiplies<Float>(),
+                                        ((Float)pixel_count/std::accumulate(output_histogram.begin(),
+                     output_histogram.end(),
+                     (Float)0))));
 
-     // Normalise histograms to sum to total number of pixels in image.
+            // Compute cumulative histogram.
 
-     unsigned int pixel_count = image.nrows() * image.ncols();
-     std::transform(input_histogram->begin(), input_histogram->end(),
-                    input_histogram->begin(),
-                    std::bind1st(std::multiplies<Float>(),
-                                 ((Float)pixel_count/std::accumulate(input_histogram->begin(),
-                input_histogram->end(),
-                (Float)0))));
-     std::transform(output_histogram.begin(), output_histogram.end(),
-                    output_histogram.begin(),
+            m_cumulative.resize(output_histogram.size());
+            std::partial_sum(output_histogram.begin(), output_histogram.end(),
+                             m_cumulative.begin());
+            m_pixel_count = pixel_count;
+        }
+        return m_cumulative;
+    }
+
+private:
+    FloatVector m_histogram;
+    FloatVector m_cumulative;
+    unsigned int m_pixel_count;
+};
+
+
+/* this function computes the table that maps pixel values of an image with
+   histogram "input_histogram" onto the reference histogram "reference".
+   Both histograms are normalised to sum to "pixel_count" first.
+ */
+template<class V>
+void equalise_transform(const FloatVector &input_histogram, reference_histogram &reference,
+                        unsigned int pixel_count, std::vector<V> &value_transform)
+{
+     typedef typename FloatVector::value_type Float;
+
+     // Define histogram for input.
+
+     FloatVector normalised_histogram(input_histogram);
+
+     // Normalise histogram to sum to total number of pixels in image.
+
+     std::transform(normalised_histogram.begin(), normalised_histogram.end(),
+                    normalised_histogram.begin(),
                     std::bind1st(std::multiplies<Float>(),
-                                 ((Float)pixel_count/std::accumulate(output_histogram.begin(),
-                output_histogram.end(),
+                                 ((Float)pixel_count/std::accumulate(normalised_histogram.begin(),
+                normalised_histogram.end(),
                 (Float)0))));
 
      // Compute cumulative histograms.
 
-     FloatVector input_cumulative_histogram(input_histogram->size());
-     std::partial_sum(input_histogram->begin(), input_histogram->end(),
+     FloatVector input_cumulative_histogram(normalised_histogram.size());
+     std::partial_sum(normalised_histogram.begin(), normalised_histogram.end(),
                       input_cumulative_histogram.begin());
-     FloatVector output_cumulative_histogram(output_histogram.size());
-     std::partial_sum(output_histogram.begin(), output_histogram.end(),
-                      output_cumulative_histogram.begin());
+     const FloatVector &output_cumulative_histogram = reference.cumulative(pixel_count);
 
      // Compute tolerances (half of histogram value or zero at
      // beginning and end).
 
-     FloatVector tolerance(*input_histogram);
+     FloatVector tolerance(normalised_histogram);
      tolerance.front() = 0;
      tolerance.back() = 0;
      std::transform(tolerance.begin(), tolerance.end(),
@@ -282,33 +570,95 @@ Image* equalise_histogram_mask(const T& image, const U& mask,
 
      // Create a transform vector.
 
-     std::vector<typename T::value_type>
-       value_transform(input_histogram->size());
-     find_transform<Float, typename T::value_type>
-       transform_function(output_cumulative_histogram,
-                          pixel_count,
-                          input_histogram->size());
-     std::transform(input_cumulative_histogram.begin(),
-                    input_cumulative_histogram.end(),
-                    tolerance.begin(),
-                    value_transform.begin(),
-                    transform_function);
+     match_histogram(input_cumulative_histogram, tolerance, output_cumulative_histogram,
+                     pixel_count, value_transform);
+}
+
+
+template<class V>
+void equalise_transform(const FloatVector &input_histogram, const FloatVector *hist,
+                        unsigned int pixel_count, std::vector<V> &value_transform)
+{
+     reference_histogram reference(*hist);
+     equalise_transform(input_histogram, reference, pixel_count, value_transform);
+}
+
 
+/* this function maps the pixels of "image" through "value_transform" into
+   "dest", which has the size of "image", by blocks of rows on "pool".
+ */
+template<class T, class V>
+void equalise_rows(const T& image, const std::vector<typename V::value_type> &value_transform, V& dest,
+                   thread_pool &pool)
+{
      // Use row and column iterators and replace pixels with
      // transform[pix_val].
 
-     typename T::const_row_iterator input_row = image.row_begin();
-     typename T::row_iterator output_row = output_image->row_begin();
-     for ( ; input_row != image.row_end(); input_row++, output_row++) {
-       typename T::const_row_iterator::iterator input_column = input_row.begin();
-       typename T::row_iterator::iterator output_column = output_row.begin();
-       for ( ; input_column != input_row.end();
-             input_column++, output_column++)
-         *output_column = value_transform[*input_column];
-     }
+     size_t nrows = image.nrows();
+     size_t blocks = std::min(pool.size(), nrows);
+     size_t last = value_transform.size() - 1;
+     pool.run(blocks, [&](size_t i) {
+       size_t begin, end;
+       block_range(nrows, blocks, i, begin, end);
+       typename T::const_row_iterator input_row = advance_rows(image.row_begin(), begin);
+       typename V::row_iterator output_row = advance_rows(dest.row_begin(), begin);
+       for (size_t y = begin; y < end; y++, input_row++, output_row++) {
+         typename T::const_row_iterator::iterator input_column = input_row.begin();
+         typename V::row_iterator::iterator output_column = output_row.begin();
+         for ( ; input_column != input_row.end();
+               input_column++, output_column++)
+           *output_column = value_transform[std::min((size_t)*input_column, last)];
+       }
+     });
+}
+
 
-     // Clean up and return.
+/* this function equalises "image" within "mask" into "dest", which has the
+   size of "image". The histograms are normalised to "pixel_count", the
+   size of the page "image" is a region of. The transform table is
+   returned in "value_transform".
+ */
+template<class T, class U, class V>
+void equalise_histogram_mask_core(const T& image, const U& mask,
+              reference_histogram &reference, unsigned int pixel_count,
+              std::vector<typename V::value_type> &value_transform, V& dest,
+              thread_pool &pool)
+{
+     // Create a transform vector.
+
+     FloatVector *input_histogram = histogram_mask(image, mask, pool);
+     equalise_transform(*input_histogram, reference, pixel_count, value_transform);
      delete input_histogram;
+
+     // Replace pixels with transform[pix_val], by blocks of rows.
+
+     equalise_rows(image, value_transform, dest, pool);
+}
+
+
+template<class T, class U>
+Image* equalise_histogram_mask(const T& image, const U& mask,
+              const FloatVector *hist)
+{
+     typedef typename ImageFactory<T>::data_type data_type;
+     typedef typename ImageFactory<T>::view_type view_type;
+
+     // Prepare the output image.
+
+     data_type* output_data = new data_type(image.size(), image.origin());
+     view_type* output_image = new view_type(*output_data);
+
+     try {
+       thread_pool pool(1);
+       reference_histogram reference(*hist);
+       std::vector<typename T::value_type> value_transform;
+       equalise_histogram_mask_core(image, mask, reference, image.nrows() * image.ncols(),
+                                    value_transform, *output_image, pool);
+     } catch (std::exception e) {
+       delete output_image;
+       delete output_data;
+       throw;
+     }
      return output_image;
 }
 
@@ -322,20 +672,207 @@ typename ImageFactory<T>::view_type* mask_fill(const T &src, const U &mask, int
 {
     typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
     typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
-  for (coord_t m=0; m<src.nrows(); m++) {
-    for (coord_t n=0; n<src.ncols(); n++) {
-      if (mask.get(Point(n, m))==0)
-        view->set(Point(n, m), color);
-      else
-        view->set(Point(n, m), src.get(Point(n, m)));
-    }
-  }
-  return view;
+    masked_view<T, U> masked(src, mask, color);
+    copy(masked.vec_begin(),
+              masked.vec_end(),
+              view->vec_begin());
+    return view;
 }
 
 
 // ------------- Gatos with Mask ---------------------
+/* number of levels covered by the Gatos threshold table of a pixel type,
+   0 for the types thresholded pixel by pixel (FLOAT).
+ */
+template<class T>
+struct gatos_levels
+{
+    enum { levels = 0 };
+};
+
+template<>
+struct gatos_levels<GreyScalePixel>
+{
+    enum { levels = 256 };
+};
+
+template<>
+struct gatos_levels<Grey16Pixel>
+{
+    enum { levels = 65536 };
+};
+
+
+/* partial sums of the Gatos parameters over a block of rows.
+ * all terms are integers, so the blocks can be summed in any order and give
+   exactly the delta and b of a sequential pass.
+ */
+struct gatos_sums
+{
+    gatos_sums() : delta_numerator(0), delta_denominator(0), b_count(0), b_sum(0) {}
+
+    void add(const gatos_sums &other)
+    {
+        delta_numerator += other.delta_numerator;
+        delta_denominator += other.delta_denominator;
+        b_count += other.b_count;
+        b_sum += other.b_sum;
+    }
+
+    double delta() const { return delta_numerator / (double)delta_denominator; }
+    double b() const { return b_sum / (double)b_count; }
+
+    double delta_numerator;
+    size_t delta_denominator;
+    size_t b_count;
+    double b_sum;
+};
+
+
+/* the difference of a pixel and its background summed into delta. It
+   wraps like std::minus<T> on 8-bit pixels; GREY16 pixels are stored in a
+   wider integer, so their difference is wrapped to 16 bits explicitly,
+   which is the 16-bit counterpart of the 8-bit delta.
+ */
+template<class T>
+inline double gatos_difference(T value, T background)
+{
+    return (T)(value - background);
+}
+
+template<>
+inline double gatos_difference<Grey16Pixel>(Grey16Pixel value, Grey16Pixel background)
+{
+    return (value - background) & 0xffff;
+}
+
+
+/* this function accumulates the sums for delta (black pixels of the
+   preliminary binarization within mask) and b (background under its white
+   pixels within mask) over the rows [begin, end), reading each image once.
+ */
+template<class T, class U, class S>
+void gatos_statistics(const T &src, const T &background, const U &binarization, const S &mask,
+                      size_t begin, size_t end, gatos_sums &sums)
+{
+    typedef typename T::value_type base_value_type;
+
+    typename T::const_row_iterator src_row = advance_rows(src.row_begin(), begin);
+    typename T::const_row_iterator background_row = advance_rows(background.row_begin(), begin);
+    typename U::const_row_iterator binarization_row = advance_rows(binarization.row_begin(), begin);
+    typename S::const_row_iterator mask_row = advance_rows(mask.row_begin(), begin);
+    for (size_t y = begin; y < end; y++, ++src_row, ++background_row, ++binarization_row, ++mask_row) {
+        typename T::const_row_iterator::iterator src_col = src_row.begin();
+        typename T::const_row_iterator::iterator background_col = background_row.begin();
+        typename U::const_row_iterator::iterator binarization_col = binarization_row.begin();
+        typename S::const_row_iterator::iterator mask_col = mask_row.begin();
+        for ( ; src_col != src_row.end(); ++src_col, ++background_col, ++binarization_col, ++mask_col) {
+            sums.delta_numerator += gatos_difference<base_value_type>(*src_col, *background_col);
+            if (*mask_col != 0) {
+                if (is_black(*binarization_col))
+                    sums.delta_denominator++;
+                else {
+                    sums.b_count++;
+                    sums.b_sum += *background_col;
+                }
+            }
+        }
+    }
+}
+
+
+/* this function tabulates the Gatos threshold for background levels
+   [begin, end): a pixel is black iff its value is below limit[background].
+ * the test "background - src > threshold(background)" turns a prefix of the
+   source levels black, so each entry is found by binary search on
+   "gatos_thresholder" itself. It is evaluated on int, which is what 8-bit
+   pixels are promoted to, so 8-bit results are the same as thresholding
+   pixel by pixel. For 16-bit pixels the difference is taken signed.
+ */
+template<class U>
+void gatos_threshold_table(const gatos_thresholder<int, U> &thresholder, size_t levels,
+                           size_t begin, size_t end, vector<unsigned int> &limit)
+{
+    gatos_thresholder<int, U> threshold(thresholder);
+    for (size_t background = begin; background < end; background++) {
+        size_t low = 0;
+        size_t high = levels;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (is_black(threshold((int)middle, (int)background)))
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        limit[background] = (unsigned int)low;
+    }
+}
+
+
+// the whole table, in blocks of levels on "pool"
+template<class U>
+void gatos_threshold_table(const gatos_thresholder<int, U> &thresholder, size_t levels,
+                           vector<unsigned int> &limit, thread_pool &pool)
+{
+    size_t blocks = pool.size();
+    pool.run(blocks, [&](size_t i) {
+        size_t begin, end;
+        block_range(levels, blocks, i, begin, end);
+        gatos_threshold_table(thresholder, levels, begin, end, limit);
+    });
+}
+
+
+/* this function thresholds the rows [begin, end) with the table of
+   "gatos_threshold_table". There is no branch in the inner loop, only a
+   lookup and a compare.
+ */
+template<class T, class V>
+void gatos_threshold_rows(const T &src, const T &background, const vector<unsigned int> &limit,
+                          V &view, size_t begin, size_t end)
+{
+    typedef typename V::value_type value_type;
+    const unsigned int* table = &limit[0];
+    size_t last = limit.size() - 1;
+
+    typename T::const_row_iterator src_row = advance_rows(src.row_begin(), begin);
+    typename T::const_row_iterator background_row = advance_rows(background.row_begin(), begin);
+    typename V::row_iterator out_row = advance_rows(view.row_begin(), begin);
+    for (size_t y = begin; y < end; y++, ++src_row, ++background_row, ++out_row) {
+        typename T::const_row_iterator::iterator src_col = src_row.begin();
+        typename T::const_row_iterator::iterator background_col = background_row.begin();
+        typename V::row_iterator::iterator out_col = out_row.begin();
+        for ( ; src_col != src_row.end(); ++src_col, ++background_col, ++out_col)
+            *out_col = (value_type)((size_t)*src_col < table[std::min((size_t)*background_col, last)]);
+    }
+}
+
+
+/* this function thresholds the rows [begin, end) pixel by pixel, for the
+   pixel types without a threshold table.
+ */
+template<class T, class V, class F>
+void gatos_threshold_rows(const T &src, const T &background, const F &thresholder,
+                          V &view, size_t begin, size_t end)
+{
+    F threshold(thresholder);
+    typename T::const_row_iterator src_row = advance_rows(src.row_begin(), begin);
+    typename T::const_row_iterator background_row = advance_rows(background.row_begin(), begin);
+    typename V::row_iterator out_row = advance_rows(view.row_begin(), begin);
+    for (size_t y = begin; y < end; y++, ++src_row, ++background_row, ++out_row)
+        std::transform(src_row.begin(),
+                       src_row.end(),
+                       background_row.begin(),
+                       out_row.begin(),
+                       threshold);
+}
+
+
 /* only unmasked region is used to compute parameters for Gatos thresholding
+ * the parameters are gathered in one pass over the images, split into row
+   blocks that run on "pool". The pixels are then thresholded through a
+   table indexed by background level (8-bit and 16-bit images), also by row
+   blocks, into "view", which has the size of "src".
 
  *background*
  Estimated background of the image.
@@ -346,78 +883,761 @@ typename ImageFactory<T>::view_type* mask_fill(const T &src, const U &mask, int
  *mask*
  Mask image that defines the process region
  */
-template<class T, class U, class S>
-OneBitImageView* gatos_threshold_mask(const T &src,
+template<class T, class U, class S, class V>
+void gatos_threshold_mask_core(const T &src,
                                  const T &background,
                                  const U &binarization,
                                  const S &mask,
                                  double q,
                                  double p1,
-                                 double p2)
+                                 double p2,
+                                 V &view,
+                                 thread_pool &pool)
 {
-    typename ImageFactory<U>::view_type* binarization1=mask_fill(binarization, mask, 0);
-    typename ImageFactory<U>::view_type* binarization2=mask_fill(binarization, mask, 1);
-
     if (src.size() != background.size())
         throw std::invalid_argument("gatos_threshold: sizes must match");
     if (background.size() != binarization.size())
         throw std::invalid_argument("gatos_threshold: sizes must match");
+    if (binarization.size() != mask.size())
+        throw std::invalid_argument("gatos_threshold: sizes must match");
 
-    typedef std::pair<unsigned int, FloatPixel> gatos_pair;
     typedef typename T::value_type base_value_type;
     typedef typename U::value_type binarization_value_type;
 
-    double delta_numerator
-        = std::inner_product(src.vec_begin(),
-                             src.vec_end(),
-                             background.vec_begin(),
-                             (double)0,
-                             double_plus<base_value_type>(),
-                             std::minus<base_value_type>());
-    unsigned int delta_denominator
-        = std::count_if(binarization1->vec_begin(),
-                        binarization1->vec_end(),
-                        is_black<binarization_value_type>);
-    double delta = delta_numerator / (double)delta_denominator;
-
-    gatos_pair b_sums
-        = std::inner_product(binarization2->vec_begin(),
-                             binarization2->vec_end(),
-                             background.vec_begin(),
-                             gatos_pair(0, 0.0),
-                             pair_plus<gatos_pair>(),
-                             gatos_accumulate
-                             <
-                             gatos_pair,
-                             binarization_value_type,
-                             base_value_type
-                             >());
-    double b = (double)b_sums.second / (double)b_sums.first;
+    size_t nrows = src.nrows();
+    size_t blocks = std::min(pool.size(), nrows);
+    vector<gatos_sums> partial(blocks);
+    pool.run(blocks, [&](size_t i) {
+        size_t begin, end;
+        block_range(nrows, blocks, i, begin, end);
+        gatos_statistics(src, background, binarization, mask, begin, end, partial[i]);
+    });
+
+    gatos_sums sums;
+    for (size_t i = 0; i < blocks; i++)
+        sums.add(partial[i]);
+    double delta = sums.delta();
+    double b = sums.b();
+
+    size_t levels = gatos_levels<base_value_type>::levels;
+    if (levels > 0) {
+        vector<unsigned int> limit(levels);
+        gatos_thresholder<int, binarization_value_type> thresholder(q, delta, b, p1, p2);
+        gatos_threshold_table(thresholder, levels, limit, pool);
+        pool.run(blocks, [&](size_t i) {
+            size_t begin, end;
+            block_range(nrows, blocks, i, begin, end);
+            gatos_threshold_rows(src, background, limit, view, begin, end);
+        });
+    }
+    else {
+        gatos_thresholder<base_value_type, binarization_value_type> thresholder(q, delta, b, p1, p2);
+        pool.run(blocks, [&](size_t i) {
+            size_t begin, end;
+            block_range(nrows, blocks, i, begin, end);
+            gatos_threshold_rows(src, background, thresholder, view, begin, end);
+        });
+    }
+}
+
 
+template<class T, class U, class S>
+OneBitImageView* gatos_threshold_mask(const T &src,
+                                 const T &background,
+                                 const U &binarization,
+                                 const S &mask,
+                                 double q,
+                                 double p1,
+                                 double p2,
+                                 thread_pool &pool)
+{
     typedef ImageFactory<OneBitImageView>::data_type data_type;
     typedef ImageFactory<OneBitImageView>::view_type view_type;
     data_type* data = new data_type(src.size(), src.origin());
     view_type* view = new view_type(*data);
 
-    std::transform(src.vec_begin(),
-                   src.vec_end(),
-                   background.vec_begin(),
-                   view->vec_begin(),
-                   gatos_thresholder
-                   <
-                   typename T::value_type,
-                   typename U::value_type
-                   >(q, delta, b, p1, p2));
-
-  delete binarization1->data();
-  delete binarization1;
-  delete binarization2->data();
-  delete binarization2;
+    try {
+        gatos_threshold_mask_core(src, background, binarization, mask, q, p1, p2, *view, pool);
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
     return view;
 }
 
 
+template<class T, class U, class S>
+OneBitImageView* gatos_threshold_mask(const T &src,
+                                 const T &background,
+                                 const U &binarization,
+                                 const S &mask,
+                                 double q,
+                                 double p1,
+                                 double p2)
+{
+    // without a pool the rows are thresholded on the calling thread
+    thread_pool pool(1);
+    return gatos_threshold_mask(src, background, binarization, mask, q, p1, p2, pool);
+}
+
+
+// ------------- Scratch Arena ---------------------
+/* working images of the fused binarization pipeline. An arena keeps its
+   buffers between pages and only reallocates them when the page size
+   changes, instead of allocating and freeing a full page at every stage.
+ * pages are processed at their own depth, so the buffers and the
+   equalization table are kept per pixel type (8-bit and 16-bit).
+ */
+class binarization_arena
+{
+public:
+    enum { GREY, WIENER, ADJUST, BACKGROUND, BUFFER_COUNT };
+
+    explicit binarization_arena(size_t threads = 0)
+        : pool(threads),
+          m_mask_data(NULL),
+          m_mask_view(NULL) {}
+
+    ~binarization_arena()
+    {
+        delete m_mask_view;
+        delete m_mask_data;
+    }
+
+    // returns the 8-bit buffer "slot" with the size and origin of the page
+    GreyScaleImageView* buffer(size_t slot, const Size &size, const Point &origin)
+    {
+        return buffer<GreyScalePixel>(slot, size, origin);
+    }
+
+    // returns the buffer "slot" of pixel type P
+    template<class P>
+    ImageView<ImageData<P> >* buffer(size_t slot, const Size &size, const Point &origin)
+    {
+        page_buffers<P> &buffers = select(P());
+        return reuse(buffers.data[slot], buffers.view[slot], size, origin);
+    }
+
+    // returns the mask buffer with the size and origin of the page
+    OneBitImageView* mask_buffer(const Size &size, const Point &origin)
+    {
+        return reuse(m_mask_data, m_mask_view, size, origin);
+    }
+
+    // histogram equalization table of the current page of pixel type P
+    template<class P>
+    std::vector<P> &value_transform()
+    {
+        return select(P()).value_transform;
+    }
+
+    // the bytes of the buffers the arena holds
+    size_t bytes() const
+    {
+        size_t total = m_grey.bytes() + m_grey16.bytes();
+        if (m_mask_data != NULL)
+            total += image_bytes(*m_mask_data);
+        return total;
+    }
+
+    // worker threads of the parallel stages
+    thread_pool pool;
+
+private:
+    binarization_arena(const binarization_arena &);
+    binarization_arena &operator=(const binarization_arena &);
+
+    template<class P>
+    struct page_buffers
+    {
+        page_buffers()
+            : data(BUFFER_COUNT, (ImageData<P>*)NULL),
+              view(BUFFER_COUNT, (ImageView<ImageData<P> >*)NULL) {}
+
+        ~page_buffers()
+        {
+            for (size_t i = 0; i < BUFFER_COUNT; i++) {
+                delete view[i];
+                delete data[i];
+            }
+        }
+
+        size_t bytes() const
+        {
+            size_t total = 0;
+            for (size_t i = 0; i < BUFFER_COUNT; i++)
+                if (data[i] != NULL)
+                    total += image_bytes(*data[i]);
+            return total;
+        }
+
+        std::vector<ImageData<P>*> data;
+        std::vector<ImageView<ImageData<P> >*> view;
+        std::vector<P> value_transform;
+    };
+
+    page_buffers<GreyScalePixel> &select(GreyScalePixel) { return m_grey; }
+    page_buffers<Grey16Pixel> &select(Grey16Pixel) { return m_grey16; }
+
+    template<class D, class V>
+    V* reuse(D* &data, V* &view, const Size &size, const Point &origin)
+    {
+        if ((data == NULL) || (view->size() != size)) {
+            delete view;
+            release_data(data);
+            view = NULL;
+            data = NULL;
+            data = account_data(new D(size, origin));
+            view = new V(*data);
+        }
+        else if (view->origin() != origin) {
+            delete view;
+            data->page_offset_x(origin.x());
+            data->page_offset_y(origin.y());
+            view = new V(*data);
+        }
+        return view;
+    }
+
+    page_buffers<GreyScalePixel> m_grey;
+    page_buffers<Grey16Pixel> m_grey16;
+    OneBitImageData* m_mask_data;
+    OneBitImageView* m_mask_view;
+};
+
+
+// ------------- Fused Masked Stages ---------------------
+/* the pixel type the pipeline runs at for pages of pixel type T: GREYSCALE
+   and GREY16 pages keep their depth, FLOAT pages are processed at 16 bits
+   and the other types at 8 bits.
+ */
+template<class T>
+struct working_pixel
+{
+    typedef GreyScalePixel type;
+};
+
+template<>
+struct working_pixel<Grey16Pixel>
+{
+    typedef Grey16Pixel type;
+};
+
+template<>
+struct working_pixel<FloatPixel>
+{
+    typedef Grey16Pixel type;
+};
+
+
+/* the stretch of FLOAT pages to the 16-bit range: a level v becomes
+   (v-min_value)*scale. Only FLOAT pages have one.
+ */
+struct working_range
+{
+    working_range() : min_value(0), scale(1) {}
+    double min_value;
+    double scale;
+};
+
+
+/* the stretch of "src" to the working depth, taken over the whole page
+   like "to_greyscale" takes it for 8 bits, so that the parts of the page
+   given to "working_page" are stretched alike.
+ */
+template<class T>
+working_range page_range(const T &)
+{
+    return working_range();
+}
+
+
+inline working_range page_range(const FloatImageView &src)
+{
+    working_range range;
+    FloatPixel min_value=*min_element(src.vec_begin(), src.vec_end());
+    FloatPixel max_value=*max_element(src.vec_begin(), src.vec_end());
+    range.min_value=min_value;
+    range.scale=(max_value-min_value>0) ? pixel_range<Grey16Pixel>::top()/(max_value-min_value) : 0.0;
+    return range;
+}
+
+
+/* the page (or a part of it) at the depth of "working_pixel". GREYSCALE and
+   GREY16 pages are used as they are; FLOAT pages are stretched with the
+   "range" of "page_range", and the other types converted to GREYSCALE,
+   into the arena.
+ */
+inline const GreyScaleImageView* working_page(const GreyScaleImageView &src, const working_range &,
+                                              binarization_arena &)
+{
+    return &src;
+}
+
+
+inline const Grey16ImageView* working_page(const Grey16ImageView &src, const working_range &,
+                                           binarization_arena &)
+{
+    return &src;
+}
+
+
+inline const Grey16ImageView* working_page(const FloatImageView &src, const working_range &range,
+                                           binarization_arena &arena)
+{
+    Grey16ImageView* page=arena.buffer<Grey16Pixel>(binarization_arena::GREY, src.size(), src.origin());
+    Grey16ImageView::vec_iterator out=page->vec_begin();
+    for (FloatImageView::const_vec_iterator in=src.vec_begin(); in!=src.vec_end(); in++, out++)
+      *out=(Grey16Pixel)((*in-range.min_value)*range.scale);
+    return page;
+}
+
+
+template<class T>
+const GreyScaleImageView* working_page(const T &src, const working_range &range, binarization_arena &arena)
+{
+    GreyScaleImageView* grey=account_image(to_greyscale(src));
+    GreyScaleImageView* page=arena.buffer(binarization_arena::GREY, grey->size(), grey->origin());
+    copy(grey->vec_begin(),
+              grey->vec_end(),
+              page->vec_begin());
+    release_image(grey);
+    return page;
+}
+
+
+/* the Sauvola bounds and dynamic range are given in 8-bit levels; this
+   function scales them to the range of pixel type P.
+ */
+template<class P>
+int sauvola_level(int level)
+{
+    return (int)(level*(pixel_range<P>::top()/255.0));
+}
+
+
+// ------------- Region of Interest ---------------------
+/* this function finds the bounding box [x0, x1] x [y0, y1] of the pixels
+   set in "mask", in coordinates relative to its upper left corner. It
+   returns false if no pixel is set.
+ */
+template<class U>
+bool mask_bounding_box(const U &mask, size_t &x0, size_t &y0, size_t &x1, size_t &y1)
+{
+  bool found=false;
+  x0=mask.ncols();
+  y0=mask.nrows();
+  x1=0;
+  y1=0;
+  typename U::const_row_iterator row=mask.row_begin();
+  for (size_t y=0; row!=mask.row_end(); ++row, ++y) {
+    size_t x=0;
+    for (typename U::const_row_iterator::iterator col=row.begin(); col!=row.end(); ++col, ++x) {
+      if (is_black(*col)) {
+        found=true;
+        x0=min(x0, x);
+        x1=max(x1, x);
+        y0=min(y0, y);
+        y1=y;
+      }
+    }
+  }
+  return found;
+}
+
+
+/* this function copies the region of "mask" with upper left corner (x0, y0)
+   (relative to the mask) into "dest". The values are copied as they are,
+   so every stage tests them as it does on the whole mask.
+ */
+template<class U, class V>
+void copy_mask_region(const U &mask, size_t x0, size_t y0, V &dest)
+{
+  typename U::const_row_iterator row=advance_rows(mask.row_begin(), y0);
+  typename V::row_iterator out_row=dest.row_begin();
+  for ( ; out_row!=dest.row_end(); ++row, ++out_row) {
+    typename U::const_row_iterator::iterator col=row.begin();
+    for (size_t x=0; x<x0; x++)
+      ++col;
+    typename V::row_iterator::iterator out_col=out_row.begin();
+    for ( ; out_col!=out_row.end(); ++col, ++out_col)
+      *out_col=*col;
+  }
+}
+
+
 // --------------------- Binarization ----------------------
+/* the binarization stages on the region "grey" of a page at the depth of
+   "working_pixel", writing the result into "result", which has the size
+   of "grey".
+ * a GREY16 page is filtered, equalised (with a 16-bit table), estimated
+   and thresholded at 16 bits, without going through 8 bits or FLOAT.
+ * what depends on the whole page is given by the caller, so a region
+   gives the pixels of the page within its mask: the noise variance of the
+   Wiener filter, the pixel count of the page for the equalization and the
+   pyramid factor of the background.
+ * the working images have their origin at (0, 0) whatever the origin of
+   "grey", as background estimation works in page coordinates.
+ * the stages run fused: masked images are read through "masked_view"
+   instead of being materialized, and the intermediate pages live in "arena",
+   which can be reused for the next page.
+ */
+template<class P, class U, class V>
+void binarization_stages(const ImageView<ImageData<P> > &grey, const U &mask,
+                         reference_histogram &reference, unsigned int pixel_count,
+                         int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                         size_t med_size, size_t factor,
+                         size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                         double q, double p1, double p2,
+                         V &result,
+                         binarization_arena &arena)
+{
+  typedef ImageView<ImageData<P> > page_type;
+
+  accounting_stage stage("wiener");
+  const page_type* src_filtered=&grey;
+  if (sign_wiener==1) {        // wiener filter
+    page_type* src_wiener=arena.buffer<P>(binarization_arena::WIENER, grey.size(), Point(0, 0));
+    wiener2_filter_core(grey, *src_wiener, wiener_width, wiener_height,
+                        max(noise_variance, std::numeric_limits<double>::min()));
+    src_filtered=src_wiener;
+  }
+    // histogram equalization within mask
+  stage.next("equalisation");
+  page_type* adjust=arena.buffer<P>(binarization_arena::ADJUST, grey.size(), Point(0, 0));
+  equalise_histogram_mask_core(mask_view(*src_filtered, mask, 0), mask, reference, pixel_count,
+                               arena.value_transform<P>(), *adjust, arena.pool);
+    // background estimation
+  stage.next("background");
+  page_type* background=background_estimation_reduced(*adjust, med_size, factor, arena.pool);
+    // sauvola binarization
+  OneBitImageView* binarization_coarse=NULL;
+  try {
+    stage.next("sauvola");
+    binarization_coarse=account_image(sauvola_threshold(*adjust, region_size, sensitivity, sauvola_level<P>(dynamic_range),
+                                                        sauvola_level<P>(lower_bound), sauvola_level<P>(upper_bound)));
+    // gatos thresholding within mask
+    stage.next("gatos");
+    gatos_threshold_mask_core(mask_view(*adjust, mask, 0), mask_view(*background, mask, 0),
+                              *binarization_coarse, mask, q, p1, p2, result, arena.pool);
+  } catch (std::exception e) {
+    release_image(background);
+    release_image(binarization_coarse);
+    throw;
+  }
+
+  release_image(background);
+  release_image(binarization_coarse);
+}
+
+
+/* this function grows the range [t0, t1] of the mask in an image of n
+   pixels to the range "binarization" processes: by "margin" pixels, and by
+   "blocks" blocks of "factor" pixels of the reduced background, with both
+   ends on the block grid of the page (or at its border).
+ */
+inline void grow_range(size_t &t0, size_t &t1, size_t n, size_t margin, size_t factor, size_t blocks)
+{
+  size_t first=t0/factor;
+  first=(first>blocks) ? first-blocks : 0;
+  t0=min(first*factor, (t0>margin) ? t0-margin : 0);
+  t0=t0/factor*factor;
+  size_t end=max((t1/factor+blocks+1)*factor, t1+margin+1);
+  end=(end+factor-1)/factor*factor;
+  t1=min(end, n)-1;
+}
+
+
+/* this function finds the region [x0, x1] x [y0, y1] of the page that
+   "binarization" processes. It returns false if "mask" is empty.
+ * it is the bounding box of the mask grown by half of the filter regions,
+   so that the pixels of the mask see the same neighbourhood as on the whole
+   page, and by 2*(m/2)+1 pixels of the background reduced by "factor",
+   where m is the median kernel at that scale. Outside the mask the
+   equalised page is one level, so the median of these pixels is that
+   level on the page and on the region, the region has the same minimum and
+   maximum for the stretch, and each pixel on its border reaches the border
+   of the page through pixels of that level: filling the holes from the
+   border of the region gives the same background as from the border of
+   the page.
+ */
+template<class U>
+bool binarization_region(const U &mask, size_t margin, size_t med_size, size_t factor,
+                         size_t &x0, size_t &y0, size_t &x1, size_t &y1)
+{
+  if (!mask_bounding_box(mask, x0, y0, x1, y1))
+    return false;
+  size_t blocks=2*(max((size_t)1, med_size/factor)/2)+1;
+  grow_range(x0, x1, mask.ncols(), margin, factor, blocks);
+  grow_range(y0, y1, mask.nrows(), margin, factor, blocks);
+  return true;
+}
+
+
+// ------------- Tiled Binarization ---------------------
+// returns the view of the region of "view" with upper left corner "ul" (relative to "view")
+template<class V>
+V region_view(const V &view, const Point &ul, const Dim &dim)
+{
+  return V(*view.data(), Point(view.ul_x()+ul.x(), view.ul_y()+ul.y()), dim);
+}
+
+
+/* this function computes the extent [t0, t1) of the tile around the core
+   [c0, c1) in an image of n pixels: the core grown by "halo" on both sides
+   and clipped to the image, widened into the image to at least "minimum"
+   pixels.
+ */
+inline void tile_extent(size_t c0, size_t c1, size_t halo, size_t minimum, size_t n, size_t &t0, size_t &t1)
+{
+  t0=(c0>halo) ? c0-halo : 0;
+  t1=min(c1+halo, n);
+  if (t1-t0<minimum) {
+    if (t0==0)
+      t1=min(minimum, n);
+    else
+      t0=(t1>minimum) ? t1-minimum : 0;
+  }
+}
+
+
+/* this function calls "tile(tile_ul, tile_dim, core_ul, core_dim)" for the
+   tiles of an image of ncols x nrows pixels, row by row: cores of "core"
+   pixels square, each in the tile of "tile_extent" around it. The tile
+   corner is relative to the image, the core corner to the tile.
+ */
+template<class F>
+void for_each_tile(size_t ncols, size_t nrows, size_t core, size_t halo, size_t minimum, F tile)
+{
+  for (size_t cy0=0; cy0<nrows; cy0+=core) {
+    for (size_t cx0=0; cx0<ncols; cx0+=core) {
+      size_t cx1=min(cx0+core, ncols);
+      size_t cy1=min(cy0+core, nrows);
+      size_t tx0, ty0, tx1, ty1;
+      tile_extent(cx0, cx1, halo, minimum, ncols, tx0, tx1);
+      tile_extent(cy0, cy1, halo, minimum, nrows, ty0, ty1);
+      tile(Point(tx0, ty0), Dim(tx1-tx0, ty1-ty0), Point(cx0-tx0, cy0-ty0), Dim(cx1-cx0, cy1-cy0));
+    }
+  }
+}
+
+
+/* this function estimates the noise variance of the Wiener filter over the
+   whole page "src", in strips of the full width and "strip_rows" rows (the
+   whole page if 0), each brought to the working depth with a halo of half
+   the Wiener region and the "range" of the page. The rows are added up in
+   the order of the whole page, so the estimate is the same whatever the
+   strips.
+ */
+template<class T>
+double page_noise_variance(const T &src, const working_range &range,
+                           size_t wiener_width, size_t wiener_height, size_t strip_rows,
+                           binarization_arena &arena)
+{
+  typedef typename working_pixel<typename T::value_type>::type pixel_type;
+  typedef ImageView<ImageData<pixel_type> > page_type;
+
+  size_t nrows=src.nrows();
+  if ((strip_rows==0) || (strip_rows>nrows))
+    strip_rows=nrows;
+  size_t halo=wiener_height/2;
+  double noise_sum=0;
+  size_t noise_samples=0;
+  for (size_t y0=0; y0<nrows; y0+=strip_rows) {
+    size_t y1=min(y0+strip_rows, nrows);
+    size_t t0=(y0>halo) ? y0-halo : 0;
+    size_t t1=min(y1+halo, nrows);
+    T strip(*src.data(), Point(src.ul_x(), src.ul_y()+t0), Dim(src.ncols(), t1-t0));
+    const page_type* grey=working_page(strip, range, arena);
+    wiener_noise_sum(*grey, wiener_width, wiener_height, 1, 0, y0-t0, grey->ncols(), y1-t0,
+                     noise_sum, noise_samples);
+  }
+  return noise_sum/noise_samples;
+}
+
+
+/* the binarization stages on the region of "src" and "mask" with upper
+   left corner (x0, y0) (relative to the images) and size "dim", computed
+   tile by tile into the same region of "result". The arguments are those
+   of "binarization_stages", and so is the result; the tiles are brought to
+   the working depth with the "range" of the whole page.
+ * every tile is a core of about "tile_size" pixels square. The Wiener
+   filter runs on the pixels it needs with a halo of half its region, and
+   Sauvola thresholding on the core with a halo of half the Sauvola region,
+   so the pixels of the core are those of the whole region and the tiles
+   join without seams.
+ * what depends on the whole region is gathered over the tiles in separate
+   passes before it is used: the histogram of the filtered region for the
+   equalization, the equalised region reduced by the pyramid factor, on
+   which the background is estimated, and the delta and b of Gatos
+   thresholding. The last pass thresholds the tiles. Nothing of the size of
+   the region is kept between the passes but the reduced region, so every
+   pass converts and filters its tiles again.
+ * besides the output, the memory is that of
+   - the buffers of a tile with both halos: the converted, filtered and
+     equalised tile, its mask, its Sauvola thresholding and the background
+     of its core;
+   - the region reduced by the pyramid factor, and the images of the
+     background estimation on it (the median, its padded copy and the
+     images of the hole filling), each the size of the reduced region.
+   The reduced region is a quarter of the region or less, so "binarization"
+   only tiles with at least one pyramid level.
+ */
+template<class T, class U, class V>
+void binarization_tiles(const T &src, const working_range &range, const U &mask, size_t x0, size_t y0, const Dim &dim,
+                        reference_histogram &reference, unsigned int pixel_count,
+                        int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                        size_t med_size, size_t factor, size_t tile_size,
+                        size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                        double q, double p1, double p2,
+                        V &result,
+                        binarization_arena &arena)
+{
+  enum { FILTER_PASS, REDUCE_PASS, GATOS_PASS, THRESHOLD_PASS };
+  static const char* const pass_names[]={"filter pass", "reduce pass", "gatos pass", "threshold pass"};
+  typedef typename working_pixel<typename T::value_type>::type pixel_type;
+  typedef ImageData<pixel_type> data_type;
+  typedef ImageView<data_type> page_type;
+
+  size_t ncols=dim.ncols();
+  size_t nrows=dim.nrows();
+  bool wiener=(sign_wiener==1);
+  size_t wiener_region=wiener ? max(wiener_width, wiener_height) : 0;
+  size_t wiener_halo=wiener_region/2;
+  size_t sauvola_halo=region_size/2;
+  size_t core=(max(tile_size, max(region_size, wiener_region))+factor-1)/factor*factor;
+  noise_variance=max(noise_variance, std::numeric_limits<double>::min());
+
+  // the tile buffers have the size of the largest tile
+  size_t halo=wiener_halo+sauvola_halo;
+  Size buffer_size(min(core+2*halo, ncols)-1, min(core+2*halo, nrows)-1);
+  Size core_size(min(core, ncols)-1, min(core, nrows)-1);
+
+  vector<unsigned int> counts(histogram_levels<pixel_type>::levels, 0);
+  size_t counted=0;
+  gatos_sums sums;
+  vector<unsigned int> limit(gatos_levels<pixel_type>::levels);
+  std::vector<pixel_type> &value_transform=arena.value_transform<pixel_type>();
+
+  accounting_stage stage("reduced page");
+  data_type* reduced_data=account_data(new data_type(Dim((ncols+factor-1)/factor, (nrows+factor-1)/factor)));
+  page_type* reduced=new page_type(*reduced_data);
+  page_type* background=NULL;
+  OneBitImageView* coarse=NULL;
+
+  // the filtered pixels of the part of the region at "ul", from the page around it
+  auto filtered_part=[&](const Point &ul, const Dim &part_dim) {
+    size_t tx0, ty0, tx1, ty1;
+    tile_extent(ul.x(), ul.x()+part_dim.ncols(), wiener_halo, wiener_region, ncols, tx0, tx1);
+    tile_extent(ul.y(), ul.y()+part_dim.nrows(), wiener_halo, wiener_region, nrows, ty0, ty1);
+    Dim tile_dim(tx1-tx0, ty1-ty0);
+    Point part_ul(ul.x()-tx0, ul.y()-ty0);
+    T tile_src(*src.data(), Point(src.ul_x()+x0+tx0, src.ul_y()+y0+ty0), tile_dim);
+    const page_type* grey=working_page(tile_src, range, arena);
+    if (!wiener)
+      return region_view(*grey, part_ul, part_dim);
+    page_type filtered=region_view(*arena.buffer<pixel_type>(binarization_arena::WIENER, buffer_size, Point(0, 0)),
+                                   Point(0, 0), tile_dim);
+    wiener2_filter_core(*grey, filtered, wiener_width, wiener_height, noise_variance);
+    return region_view(filtered, part_ul, part_dim);
+  };
+  auto tile_mask=[&](const Point &ul, const Dim &tile_dim) {
+    OneBitImageView view=region_view(*arena.mask_buffer(buffer_size, Point(0, 0)), Point(0, 0), tile_dim);
+    copy_mask_region(mask, x0+ul.x(), y0+ul.y(), view);
+    return view;
+  };
+  auto tile_adjust=[&](const page_type &filtered, const OneBitImageView &view_mask) {
+    page_type adjust=region_view(*arena.buffer<pixel_type>(binarization_arena::ADJUST, buffer_size, Point(0, 0)),
+                                 Point(0, 0), Dim(filtered.ncols(), filtered.nrows()));
+    equalise_rows(mask_view(filtered, view_mask, 0), value_transform, adjust, arena.pool);
+    return adjust;
+  };
+  auto core_background=[&](const Point &ul, const Dim &core_dim) {
+    page_type view=region_view(*arena.buffer<pixel_type>(binarization_arena::BACKGROUND, core_size, Point(0, 0)),
+                               Point(0, 0), core_dim);
+    expand_bilinear_core(*background, factor, ul, view);
+    return view;
+  };
+
+  try {
+    // the histogram of the filtered region
+    stage.next(pass_names[FILTER_PASS]);
+    for_each_tile(ncols, nrows, core, 0, 0,
+                  [&](const Point &ul, const Dim &tile_dim, const Point &, const Dim &) {
+      page_type filtered=filtered_part(ul, tile_dim);
+      OneBitImageView mask_core=tile_mask(ul, tile_dim);
+      counted+=histogram_mask_rows(filtered, mask_core, 0, tile_dim.nrows(), counts);
+    });
+    FloatVector histogram(counts.size());
+    for (size_t k=0; k<counts.size(); k++)
+      histogram[k]=counts[k]/(double)counted;
+    equalise_transform(histogram, reference, pixel_count, value_transform);
+
+    // the equalised region reduced by the pyramid factor, and its background
+    stage.next(pass_names[REDUCE_PASS]);
+    for_each_tile(ncols, nrows, core, 0, 0,
+                  [&](const Point &ul, const Dim &tile_dim, const Point &, const Dim &) {
+      page_type adjust=tile_adjust(filtered_part(ul, tile_dim), tile_mask(ul, tile_dim));
+      page_type* block=account_image(reduce_mean(adjust, factor));
+      page_type reduced_core=region_view(*reduced, Point(ul.x()/factor, ul.y()/factor), Dim(block->ncols(), block->nrows()));
+      copy(block->vec_begin(), block->vec_end(), reduced_core.vec_begin());
+      release_image(block);
+    });
+    stage.next("background");
+    background=background_estimation(*reduced, std::max((size_t)1, med_size/factor), arena.pool);
+    delete reduced;
+    release_data(reduced_data);
+    reduced=NULL;
+    reduced_data=NULL;
+
+    // Sauvola thresholding, and the delta and b of Gatos thresholding
+    stage.next(pass_names[GATOS_PASS]);
+    for_each_tile(ncols, nrows, core, sauvola_halo, region_size,
+                  [&](const Point &ul, const Dim &tile_dim, const Point &core_ul, const Dim &core_dim) {
+      page_type filtered=filtered_part(ul, tile_dim);
+      OneBitImageView mask_tile=tile_mask(ul, tile_dim);
+      page_type adjust=tile_adjust(filtered, mask_tile);
+      page_type background_core=core_background(Point(ul.x()+core_ul.x(), ul.y()+core_ul.y()), core_dim);
+      coarse=account_image(sauvola_threshold(adjust, region_size, sensitivity, sauvola_level<pixel_type>(dynamic_range),
+                                             sauvola_level<pixel_type>(lower_bound), sauvola_level<pixel_type>(upper_bound)));
+      OneBitImageView mask_core=region_view(mask_tile, core_ul, core_dim);
+      gatos_statistics(mask_view(region_view(adjust, core_ul, core_dim), mask_core, 0), mask_view(background_core, mask_core, 0),
+                       region_view(*coarse, core_ul, core_dim), mask_core, 0, core_dim.nrows(), sums);
+      release_image(coarse);
+      coarse=NULL;
+    });
+    gatos_thresholder<int, OneBitPixel> thresholder(q, sums.delta(), sums.b(), p1, p2);
+    gatos_threshold_table(thresholder, limit.size(), limit, arena.pool);
+
+    // Gatos thresholding
+    stage.next(pass_names[THRESHOLD_PASS]);
+    for_each_tile(ncols, nrows, core, 0, 0,
+                  [&](const Point &ul, const Dim &tile_dim, const Point &, const Dim &) {
+      OneBitImageView mask_core=tile_mask(ul, tile_dim);
+      page_type adjust_core=tile_adjust(filtered_part(ul, tile_dim), mask_core);
+      page_type background_core=core_background(ul, tile_dim);
+      V result_core=region_view(result, Point(x0+ul.x(), y0+ul.y()), tile_dim);
+      size_t blocks=std::min(arena.pool.size(), tile_dim.nrows());
+      arena.pool.run(blocks, [&](size_t i) {
+        size_t begin, end;
+        block_range(tile_dim.nrows(), blocks, i, begin, end);
+        gatos_threshold_rows(mask_view(adjust_core, mask_core, 0), mask_view(background_core, mask_core, 0),
+                             limit, result_core, begin, end);
+      });
+    });
+  } catch (std::exception e) {
+    delete reduced;
+    release_data(reduced_data);
+    release_image(background);
+    release_image(coarse);
+    throw;
+  }
+
+  release_image(background);
+}
+
+
 /* this is the main function for binarization
 
  *mask*
@@ -432,12 +1652,132 @@ OneBitImageView* gatos_threshold_mask(const T &src,
  *med_size*
  The kernel for median filter.
 
+ *pyramid_levels*
+ number of halvings of the page for background estimation, 0 for full resolution
+
+ *tile_size*
+ size of the tiles of "binarization_tiles", 0 to process the page at once.
+ Tiling gives the same result and needs at least one pyramid level; a page
+ too small for one is processed at once.
+
  *region size*, *sensitivity*, *dynamic range*, *lower bound*, *upper bound*
  parameters for sauvola binarization
 
  *q*, *p1*, *p2*
  parameters for gatos thresholding
+
+ * only the region of "binarization_region" around the mask is processed,
+   with the noise variance, the pixel count and the pyramid factor of the
+   whole page, so the result is that of the whole page. The rest of the
+   output is white.
  */
+template<class T, class U>
+OneBitImageView* binarization(const T &src, const U &mask, reference_histogram &reference,
+                              int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                size_t med_size, int pyramid_levels, size_t tile_size,
+                size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                double q, double p1, double p2,
+                binarization_arena &arena)
+{
+  if (src.size()!=mask.size())
+    throw std::invalid_argument("binarization: sizes must match");
+  if ((tile_size>0) && (pyramid_levels<1))
+    throw std::invalid_argument("binarization: tiles need at least one pyramid level");
+
+  typedef ImageFactory<OneBitImageView>::data_type data_type;
+  typedef ImageFactory<OneBitImageView>::view_type view_type;
+  accounting_stage stage("output");
+  data_type* data=account_data(new data_type(src.size(), src.origin()));
+  view_type* result=new view_type(*data);
+  stage.close();
+
+  try {
+    typedef typename working_pixel<typename T::value_type>::type pixel_type;
+    typedef ImageView<ImageData<pixel_type> > page_type;
+
+    // the filter regions must fit in the processed region
+    size_t region=max(med_size, region_size);
+    if (sign_wiener==1)
+      region=max(region, max(wiener_width, wiener_height));
+    size_t factor=pyramid_factor(src.ncols(), src.nrows(), med_size, pyramid_levels);
+    working_range range=page_range(src);
+    size_t x0, y0, x1, y1;
+    if (binarization_region(mask, region/2, med_size, factor, x0, y0, x1, y1)) {
+      if ((x1-x0+1<region) || (y1-y0+1<region)) {
+        x0=0;
+        y0=0;
+        x1=src.ncols()-1;
+        y1=src.nrows()-1;
+      }
+
+      Point ul(src.ul_x()+x0, src.ul_y()+y0);
+      Dim dim(x1-x0+1, y1-y0+1);
+      if ((tile_size>0) && (factor>1)) {
+        if ((sign_wiener==1) && (noise_variance<=0)) {
+          // strips of about the pixels of a tile
+          accounting_stage noise_stage("noise");
+          size_t strip_rows=max((size_t)1, tile_size*tile_size/src.ncols());
+          noise_variance=page_noise_variance(src, range, wiener_width, wiener_height, strip_rows, arena);
+        }
+        binarization_tiles(src, range, mask, x0, y0, dim, reference, src.ncols()*src.nrows(),
+                           sign_wiener, wiener_width, wiener_height, noise_variance,
+                           med_size, factor, tile_size,
+                           region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                           q, p1, p2,
+                           *result, arena);
+        return result;
+      }
+
+      accounting_stage page_stage("greyscale");
+      const page_type* grey=working_page(src, range, arena);
+      if ((sign_wiener==1) && (noise_variance<=0)) {
+        page_stage.next("noise");
+        double noise_sum=0;
+        size_t noise_samples=0;
+        wiener_noise_sum(*grey, wiener_width, wiener_height, 1, 0, 0, grey->ncols(), grey->nrows(),
+                         noise_sum, noise_samples);
+        noise_variance=noise_sum/noise_samples;
+      }
+      page_stage.next("mask");
+      OneBitImageView* mask_region=arena.mask_buffer(Size(dim.ncols()-1, dim.nrows()-1), ul);
+      copy_mask_region(mask, x0, y0, *mask_region);
+      page_stage.close();
+      view_type result_region(*data, ul, dim);
+      binarization_stages(region_view(*grey, Point(x0, y0), dim), *mask_region,
+                          reference, src.ncols()*src.nrows(),
+                          sign_wiener, wiener_width, wiener_height, noise_variance,
+                          med_size, factor,
+                          region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                          q, p1, p2,
+                          result_region, arena);
+    }
+  } catch (std::exception e) {
+    delete result;
+    release_data(data);
+    throw;
+  }
+  return result;
+}
+
+
+template<class T, class U>
+OneBitImageView* binarization(const T &src, const U &mask, const FloatVector *hist,
+                              int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                size_t med_size,
+                size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                double q, double p1, double p2,
+                binarization_arena &arena)
+{
+  reference_histogram reference(*hist);
+  return binarization(src, mask, reference,
+                      sign_wiener, wiener_width, wiener_height, noise_variance,
+                      med_size, 0, 0,
+                      region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                      q, p1, p2,
+                      arena);
+}
+
+
 template<class T, class U>
 OneBitImageView* binarization(const T &src, const U &mask, const FloatVector *hist,
                               int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
@@ -445,42 +1785,191 @@ OneBitImageView* binarization(const T &src, const U &mask, const FloatVector *hi
                 size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
                 double q, double p1, double p2)
 {
-  GreyScaleImageView* src_grey=to_greyscale(src);
-  if (sign_wiener==1) {        // wiener filter
-    GreyScaleImageView* src_wiener=wiener2_filter(*src_grey, wiener_width, wiener_height, noise_variance);
-    delete src_grey->data();
-    delete src_grey;
-    src_grey=src_wiener;
+  binarization_arena arena(1);
+  return binarization(src, mask, hist,
+                      sign_wiener, wiener_width, wiener_height, noise_variance,
+                      med_size,
+                      region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                      q, p1, p2,
+                      arena);
+}
+
+
+/* the same as "binarization", with the memory accounting of the page by
+   stage. It returns the tuple (image, accounting) where the accounting is
+   a dict (see "memory_accounting"), and appends the accounting to
+   "json_file" as a line of JSON unless it is empty.
+ */
+template<class T, class U>
+PyObject* binarization_with_accounting(const T &src, const U &mask, const FloatVector *hist,
+                                       int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                size_t med_size,
+                size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                double q, double p1, double p2,
+                const char* json_file)
+{
+  memory_accounting accounting("binarization");
+  accounting.page(src.ncols(), src.nrows());
+  OneBitImageView* result;
+  {
+    accounting_scope scope(accounting);
+    result=binarization(src, mask, hist,
+                        sign_wiener, wiener_width, wiener_height, noise_variance,
+                        med_size,
+                        region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                        q, p1, p2);
   }
-    // apply mask
-  GreyScaleImageView* src_mask_black=mask_fill(*src_grey, mask, 0);
-    // histogram equalization
-  Image* adjust0=equalise_histogram_mask(*src_mask_black, mask, hist);
-  GreyScaleImageView* adjust=static_cast<GreyScaleImageView*> (adjust0);
-  GreyScaleImageView* adjust_mask_black=mask_fill(*adjust, mask, 0);
-    // background estimation
-  GreyScaleImageView* background=background_estimation(*adjust, med_size);
-  GreyScaleImageView* background_mask_black=mask_fill(*background, mask, 0);
-    // sauvola binarization
-  OneBitImageView* binarization_coarse=sauvola_threshold(*adjust, region_size, sensitivity, dynamic_range, lower_bound, upper_bound);
-    // gatos thresholding
-  OneBitImageView* binarization=gatos_threshold_mask(*adjust_mask_black, *background_mask_black, *binarization_coarse, mask, q, p1, p2);
-
-  delete src_grey->data();
-  delete src_grey;
-  delete src_mask_black->data();
-  delete src_mask_black;
-  delete adjust->data();
-  delete adjust;
-  delete adjust_mask_black->data();
-  delete adjust_mask_black;
-  delete background->data();
-  delete background;
-  delete background_mask_black->data();
-  delete background_mask_black;
-  delete binarization_coarse->data();
-  delete binarization_coarse;
-  return binarization;
+  return accounted_result(result, accounting, json_file);
+}
+
+
+// ------------- Binarization Context ---------------------
+/* what "binarization" needs across the pages of a book binarized with one
+   set of parameters: the parameters, the reference histogram and its
+   cumulative histogram, the working buffers and the worker threads. It is
+   built once, and "binarize" then only does the work of the page.
+ * if the page size is given, the 8-bit buffers and the cumulative
+   reference histogram are prepared for that size up front. Tiled binarization
+   prepares its tile buffers on the first page.
+ */
+class binarization_context
+{
+public:
+    binarization_context(const FloatVector *hist,
+                         int sign_wiener, size_t wiener_width, size_t wiener_height, double noise_variance,
+                         size_t med_size, int pyramid_levels, size_t tile_size,
+                         size_t region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                         double q, double p1, double p2,
+                         size_t threads, size_t page_width, size_t page_height)
+        : m_reference(*hist),
+          m_sign_wiener(sign_wiener), m_wiener_width(wiener_width), m_wiener_height(wiener_height),
+          m_noise_variance(noise_variance),
+          m_med_size(med_size), m_pyramid_levels(pyramid_levels), m_tile_size(tile_size),
+          m_region_size(region_size), m_sensitivity(sensitivity), m_dynamic_range(dynamic_range),
+          m_lower_bound(lower_bound), m_upper_bound(upper_bound),
+          m_q(q), m_p1(p1), m_p2(p2),
+          m_arena(threads)
+    {
+        if ((page_width > 0) && (page_height > 0)) {
+            Size size(page_width - 1, page_height - 1);
+            if (tile_size == 0) {
+                m_arena.buffer(binarization_arena::ADJUST, size, Point(0, 0));
+                if (sign_wiener == 1)
+                    m_arena.buffer(binarization_arena::WIENER, size, Point(0, 0));
+            }
+            m_reference.cumulative(page_width * page_height);
+        }
+    }
+
+    template<class T, class U>
+    OneBitImageView* binarize(const T &src, const U &mask)
+    {
+        return binarization(src, mask, m_reference,
+                            m_sign_wiener, m_wiener_width, m_wiener_height, m_noise_variance,
+                            m_med_size, m_pyramid_levels, m_tile_size,
+                            m_region_size, m_sensitivity, m_dynamic_range, m_lower_bound, m_upper_bound,
+                            m_q, m_p1, m_p2,
+                            m_arena);
+    }
+
+    // the bytes of the working buffers kept between pages
+    size_t bytes() const { return m_arena.bytes(); }
+
+private:
+    binarization_context(const binarization_context &);
+    binarization_context &operator=(const binarization_context &);
+
+    reference_histogram m_reference;
+    int m_sign_wiener;
+    size_t m_wiener_width, m_wiener_height;
+    double m_noise_variance;
+    size_t m_med_size;
+    int m_pyramid_levels;
+    size_t m_tile_size;
+    size_t m_region_size;
+    double m_sensitivity;
+    int m_dynamic_range, m_lower_bound, m_upper_bound;
+    double m_q, m_p1, m_p2;
+    binarization_arena m_arena;
+};
+
+
+/* the context is handed to Python as a capsule, which deletes the context
+   when Python releases it.
+ */
+inline void binarization_context_release(PyObject* capsule)
+{
+  delete (binarization_context*)PyCapsule_GetPointer(capsule, "binarization_context");
+}
+
+
+inline PyObject* create_binarization_context(const FloatVector *hist,
+                              int sign_wiener, int wiener_width, int wiener_height, double noise_variance,
+                int med_size, int pyramid_levels, int tile_size,
+                int region_size, double sensitivity, int dynamic_range, int lower_bound, int upper_bound,
+                double q, double p1, double p2,
+                int threads, int page_width, int page_height)
+{
+  if ((threads < 0) || (tile_size < 0) || (page_width < 0) || (page_height < 0))
+    throw std::invalid_argument("create_binarization_context: threads, tile size and page size must not be negative");
+  if ((tile_size > 0) && (pyramid_levels < 1))
+    throw std::invalid_argument("create_binarization_context: tiles need at least one pyramid level");
+
+  binarization_context* context=new binarization_context(hist,
+                      sign_wiener, wiener_width, wiener_height, noise_variance,
+                      med_size, pyramid_levels, tile_size,
+                      region_size, sensitivity, dynamic_range, lower_bound, upper_bound,
+                      q, p1, p2,
+                      threads, page_width, page_height);
+  PyObject* capsule=PyCapsule_New(context, "binarization_context", binarization_context_release);
+  if (capsule==NULL)
+    delete context;
+  return capsule;
+}
+
+
+// the context in a capsule made by "create_binarization_context"
+inline binarization_context* binarization_context_pointer(PyObject* context, const char* function)
+{
+  binarization_context* c=(binarization_context*)PyCapsule_GetPointer(context, "binarization_context");
+  if (c==NULL) {
+    PyErr_Clear();
+    throw std::invalid_argument(std::string(function)+": context must be made by create_binarization_context");
+  }
+  return c;
+}
+
+
+/* binarization of one page with a context made by
+   "create_binarization_context".
+ */
+template<class T, class U>
+OneBitImageView* binarization_in_context(const T &src, const U &mask, PyObject* context)
+{
+  return binarization_context_pointer(context, "binarization_in_context")->binarize(src, mask);
+}
+
+
+/* the same as "binarization_in_context", with the memory accounting of the
+   page by stage. It returns the tuple (image, accounting) where the
+   accounting is a dict (see "memory_accounting"), and appends the
+   accounting to "json_file" as a line of JSON unless it is empty.
+ * the buffers the context kept from the previous page count towards the
+   high-water marks from the start.
+ */
+template<class T, class U>
+PyObject* binarization_in_context_with_accounting(const T &src, const U &mask, PyObject* context, const char* json_file)
+{
+  binarization_context* c=binarization_context_pointer(context, "binarization_in_context_with_accounting");
+  memory_accounting accounting("binarization");
+  accounting.page(src.ncols(), src.nrows());
+  accounting.hold(c->bytes());
+  OneBitImageView* result;
+  {
+    accounting_scope scope(accounting);
+    result=c->binarize(src, mask);
+  }
+  return accounted_result(result, accounting, json_file);
 }
 
 #endif
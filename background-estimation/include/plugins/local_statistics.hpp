@@ -0,0 +1,168 @@
+#ifndef LOCAL_STATISTICS_HPP
+#define LOCAL_STATISTICS_HPP
+
+#include "gamera.hpp"
+
+#include <vector>
+#include <algorithm>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Local Window =======================
+/* this function computes the region around (x, y) used by the local-window
+   filters (wiener, median, mean). The region is clipped at the image border
+   in the same way as the "rect_set(ul, lr)" idiom of the original filters,
+   so the number of pixels in the region shrinks near the border.
+ */
+inline void local_window(coord_t x, coord_t y,
+                         size_t half_region_width, size_t half_region_height,
+                         size_t ncols, size_t nrows,
+                         coord_t &x0, coord_t &y0, coord_t &x1, coord_t &y1)
+{
+    x0 = (coord_t)std::max(0, (int)x - (int)half_region_width);
+    y0 = (coord_t)std::max(0, (int)y - (int)half_region_height);
+    x1 = (coord_t)std::min(x + half_region_width, ncols - 1);
+    y1 = (coord_t)std::min(y + half_region_height, nrows - 1);
+}
+
+
+// ===================== Accumulators =======================
+/* accumulator types of the window sums.
+ * 8-bit and 16-bit pixels are accumulated exactly in 64-bit integers: the sum
+   of squares of a 16-bit page stays below 2^64 up to ~4e9 pixels. Other pixel
+   types (FLOAT) fall back to double precision.
+ */
+template<class T>
+struct integral_traits
+{
+    typedef double sum_type;
+};
+
+template<>
+struct integral_traits<GreyScalePixel>
+{
+    typedef unsigned long long sum_type;
+};
+
+template<>
+struct integral_traits<Grey16Pixel>
+{
+    typedef unsigned long long sum_type;
+};
+
+
+// ===================== Rolling Window =======================
+/* sums of the pixel values and of their squares over a window of rows that
+   slides down an image "I", one row at a time.
+ * the sums are kept per column, so moving down one row adds the entering
+   row and subtracts the leaving one. For a row that is looked up, running
+   sums along the row give the mean and variance of any column range of the
+   window in constant time. Only a few rows of accumulators are kept,
+   instead of page-size summed-area tables, and the results are the same.
+ * the window covers the rows within "half_region_height" of the current
+   row, clipped at the image border like "local_window".
+ */
+template<class I>
+class rolling_window
+{
+public:
+    typedef typename integral_traits<typename I::value_type>::sum_type sum_type;
+
+    rolling_window(const I &src, size_t half_region_height)
+        : m_nrows(src.nrows()),
+          m_ncols(src.ncols()),
+          m_half_region_height(half_region_height),
+          m_row(0),
+          m_started(false),
+          m_entering(src.row_begin()),
+          m_leaving(src.row_begin()),
+          m_column_sum(src.ncols(), (sum_type)0),
+          m_column_sum_squares(src.ncols(), (sum_type)0),
+          m_sum(src.ncols() + 1, (sum_type)0),
+          m_sum_squares(src.ncols() + 1, (sum_type)0) {}
+
+    /* moves the window to the next row, row 0 at the first call. Lookups
+       are prepared only if "lookup" is set.
+     */
+    void next_row(bool lookup = true)
+    {
+        if (!m_started) {
+            m_started = true;
+            for (size_t y = 0; y <= std::min(m_half_region_height, m_nrows - 1); ++y, ++m_entering)
+                add_row(m_entering);
+        }
+        else {
+            m_row++;
+            if (m_row > m_half_region_height) {
+                subtract_row(m_leaving);
+                ++m_leaving;
+            }
+            if (m_row + m_half_region_height < m_nrows) {
+                add_row(m_entering);
+                ++m_entering;
+            }
+        }
+        if (lookup) {
+            for (size_t x = 0; x < m_ncols; ++x) {
+                m_sum[x + 1] = m_sum[x] + m_column_sum[x];
+                m_sum_squares[x + 1] = m_sum_squares[x] + m_column_sum_squares[x];
+            }
+        }
+    }
+
+    size_t row() const { return m_row; }
+
+    /* mean and variance of the columns [x0, x1] (inclusive) of the window
+       of the current row.
+     * the variance is the unbiased estimate (divided by n-1), as in the
+       original wiener filter. It is computed as (n*S2 - S*S) / (n*(n-1)),
+       whose numerator is exact for integer pixel types.
+     */
+    void mean_variance(coord_t x0, coord_t x1, double &mean, double &variance) const
+    {
+        size_t y0 = (m_row > m_half_region_height) ? m_row - m_half_region_height : 0;
+        size_t y1 = std::min(m_row + m_half_region_height, m_nrows - 1);
+        sum_type n = (sum_type)((x1 - x0 + 1) * (y1 - y0 + 1));
+        sum_type s = m_sum[x1 + 1] - m_sum[x0];
+        sum_type s2 = m_sum_squares[x1 + 1] - m_sum_squares[x0];
+        mean = (double)s / (double)n;
+        variance = (double)(n * s2 - s * s) / ((double)n * (double)(n - 1));
+    }
+
+private:
+    void add_row(const typename I::const_row_iterator &row)
+    {
+        size_t x = 0;
+        for (typename I::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x) {
+            sum_type value = (sum_type)(*col);
+            m_column_sum[x] += value;
+            m_column_sum_squares[x] += value * value;
+        }
+    }
+
+    void subtract_row(const typename I::const_row_iterator &row)
+    {
+        size_t x = 0;
+        for (typename I::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x) {
+            sum_type value = (sum_type)(*col);
+            m_column_sum[x] -= value;
+            m_column_sum_squares[x] -= value * value;
+        }
+    }
+
+    size_t m_nrows;
+    size_t m_ncols;
+    size_t m_half_region_height;
+    size_t m_row;
+    bool m_started;
+    typename I::const_row_iterator m_entering;
+    typename I::const_row_iterator m_leaving;
+    vector<sum_type> m_column_sum;
+    vector<sum_type> m_column_sum_squares;
+    vector<sum_type> m_sum;
+    vector<sum_type> m_sum_squares;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef MASKED_VIEW_HPP
+#define MASKED_VIEW_HPP
+
+#include "gamera.hpp"
+
+#include <iterator>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Masked View =======================
+/* iterator over a source and a mask in lockstep. It reads the source pixel
+   where the mask is set and "fill" elsewhere. Works on both vector and
+   column iterators of the underlying views.
+ */
+template<class SrcIterator, class MaskIterator, class V>
+class masked_iterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef V value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const V* pointer;
+    typedef V reference;
+
+    masked_iterator() {}
+    masked_iterator(const SrcIterator &src, const MaskIterator &mask, V fill)
+        : m_src(src), m_mask(mask), m_fill(fill) {}
+
+    V operator*() const { return (*m_mask == 0) ? m_fill : (V)*m_src; }
+
+    masked_iterator &operator++() { ++m_src; ++m_mask; return *this; }
+    masked_iterator operator++(int) { masked_iterator tmp(*this); ++(*this); return tmp; }
+
+    bool operator==(const masked_iterator &other) const { return m_src == other.m_src; }
+    bool operator!=(const masked_iterator &other) const { return m_src != other.m_src; }
+
+private:
+    SrcIterator m_src;
+    MaskIterator m_mask;
+    V m_fill;
+};
+
+
+/* read-only view of "src" in which the pixels outside "mask" (mask value 0)
+   read as "fill". It replaces materializing the same image with "mask_fill":
+   nothing is copied, the mask is applied while iterating.
+ * it provides the parts of the image view interface used by the toolkit
+   kernels: get(), size queries, vector iterators and row/column iterators.
+   Images allocated from it through ImageFactory have the pixel type of "src".
+ */
+template<class T, class U>
+class masked_view
+{
+public:
+    typedef typename T::value_type value_type;
+    typedef typename T::data_type data_type;
+    typedef masked_iterator<typename T::const_vec_iterator,
+                            typename U::const_vec_iterator,
+                            value_type> const_vec_iterator;
+
+    class const_row_iterator
+    {
+    public:
+        typedef masked_iterator<typename T::const_row_iterator::iterator,
+                                typename U::const_row_iterator::iterator,
+                                value_type> iterator;
+
+        const_row_iterator(const typename T::const_row_iterator &src,
+                           const typename U::const_row_iterator &mask,
+                           value_type fill)
+            : m_src(src), m_mask(mask), m_fill(fill) {}
+
+        iterator begin() const { return iterator(m_src.begin(), m_mask.begin(), m_fill); }
+        iterator end() const { return iterator(m_src.end(), m_mask.end(), m_fill); }
+
+        const_row_iterator &operator++() { ++m_src; ++m_mask; return *this; }
+        const_row_iterator operator++(int) { const_row_iterator tmp(*this); ++(*this); return tmp; }
+
+        bool operator==(const const_row_iterator &other) const { return m_src == other.m_src; }
+        bool operator!=(const const_row_iterator &other) const { return m_src != other.m_src; }
+
+    private:
+        typename T::const_row_iterator m_src;
+        typename U::const_row_iterator m_mask;
+        value_type m_fill;
+    };
+    typedef typename const_row_iterator::iterator const_col_iterator;
+
+    masked_view(const T &src, const U &mask, value_type fill)
+        : m_src(src), m_mask(mask), m_fill(fill)
+    {
+        if (src.size() != mask.size())
+            throw std::invalid_argument("masked_view: sizes must match");
+    }
+
+    const T &source() const { return m_src; }
+    const U &mask() const { return m_mask; }
+    value_type fill() const { return m_fill; }
+
+    size_t nrows() const { return m_src.nrows(); }
+    size_t ncols() const { return m_src.ncols(); }
+    Size size() const { return m_src.size(); }
+    Point origin() const { return m_src.origin(); }
+    Point ul() const { return m_src.ul(); }
+
+    value_type get(const Point &p) const
+    {
+        return (m_mask.get(p) == 0) ? m_fill : m_src.get(p);
+    }
+
+    const_vec_iterator vec_begin() const
+    {
+        return const_vec_iterator(m_src.vec_begin(), m_mask.vec_begin(), m_fill);
+    }
+    const_vec_iterator vec_end() const
+    {
+        return const_vec_iterator(m_src.vec_end(), m_mask.vec_end(), m_fill);
+    }
+
+    const_row_iterator row_begin() const
+    {
+        return const_row_iterator(m_src.row_begin(), m_mask.row_begin(), m_fill);
+    }
+    const_row_iterator row_end() const
+    {
+        return const_row_iterator(m_src.row_end(), m_mask.row_end(), m_fill);
+    }
+
+private:
+    const T &m_src;
+    const U &m_mask;
+    value_type m_fill;
+};
+
+
+// returns the masked view of "src", with the template arguments deduced
+template<class T, class U>
+masked_view<T, U> mask_view(const T &src, const U &mask, typename T::value_type fill)
+{
+    return masked_view<T, U>(src, mask, fill);
+}
+
+#endif
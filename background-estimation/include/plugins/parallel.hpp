@@ -0,0 +1,263 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+
+// ===================== Thread Pool =======================
+/* a fixed set of worker threads that run numbered tasks. "run(n, task)"
+   calls task(0) ... task(n-1) on the workers and on the calling thread, and
+   returns when all of them are finished. The first exception thrown by a
+   task is rethrown by "run".
+ * the threads are started once and reused, so a pool can be kept for a
+   whole batch of pages. One "run" executes at a time.
+ * "threads" is the total number of threads including the caller; 0 uses
+   one thread per hardware core, and 1 starts no threads: the tasks run
+   on the caller, as in the overloads of the plugins that take no pool.
+ * a "run" called from inside a task, of this pool or another one, calls
+   the tasks in order on the calling thread, so nested parallel stages
+   cannot wait for the threads they run on.
+ */
+class thread_pool
+{
+public:
+    explicit thread_pool(size_t threads = 0)
+        : m_stop(false), m_generation(0), m_job(NULL), m_tasks(0), m_active(0)
+    {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 1; i < threads; i++)
+            m_workers.push_back(std::thread(&thread_pool::worker, this));
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (size_t i = 0; i < m_workers.size(); i++)
+            m_workers[i].join();
+    }
+
+    // the number of threads a "run" from the calling thread uses
+    size_t size() const { return in_task() ? 1 : m_workers.size() + 1; }
+
+    // true on a thread that is running a task of a pool
+    static bool &in_task()
+    {
+        static thread_local bool running = false;
+        return running;
+    }
+
+    template<class F>
+    void run(size_t tasks, F task)
+    {
+        if (tasks == 0)
+            return;
+        if (m_workers.empty() || (tasks == 1) || in_task()) {
+            for (size_t i = 0; i < tasks; i++)
+                task(i);
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(m_run_mutex);
+        std::function<void(size_t)> job(task);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &job;
+            m_tasks = tasks;
+            m_next = 0;
+            m_active = m_workers.size();
+            m_error = std::exception_ptr();
+            m_generation++;
+        }
+        m_wake.notify_all();
+        execute();
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_active > 0)
+                m_done.wait(lock);
+            m_job = NULL;
+        }
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    thread_pool(const thread_pool &);
+    thread_pool &operator=(const thread_pool &);
+
+    void execute()
+    {
+        size_t i;
+        in_task() = true;
+        while ((i = m_next++) < m_tasks) {
+            try {
+                (*m_job)(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_error)
+                    m_error = std::current_exception();
+            }
+        }
+        in_task() = false;
+    }
+
+    void worker()
+    {
+        size_t generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_stop && (m_generation == generation))
+                    m_wake.wait(lock);
+                if (m_stop)
+                    return;
+                generation = m_generation;
+            }
+            execute();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_active == 0)
+                    m_done.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::mutex m_run_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    bool m_stop;
+    size_t m_generation;
+    std::function<void(size_t)>* m_job;
+    size_t m_tasks;
+    std::atomic<size_t> m_next;
+    size_t m_active;
+    std::exception_ptr m_error;
+};
+
+
+// ===================== Task Graph =======================
+/* a set of tasks with dependencies, run on a thread pool. A task starts as
+   soon as the tasks it depends on are finished, on any free thread.
+ * "add(task, after)" adds a task that runs after the tasks numbered in
+   "after" (which must have been added before) and returns its number.
+ * "run(pool)" returns when all the tasks are finished. If a task throws,
+   no further task is started and the first exception is rethrown once
+   the running tasks are finished.
+ */
+class task_graph
+{
+public:
+    task_graph() : m_pending(0) {}
+
+    size_t add(const std::function<void()> &task, const std::vector<size_t> &after = std::vector<size_t>())
+    {
+        node n;
+        n.task = task;
+        n.dependencies = after.size();
+        n.waiting = 0;
+        m_nodes.push_back(n);
+        for (size_t i = 0; i < after.size(); i++)
+            m_nodes[after[i]].next.push_back(m_nodes.size() - 1);
+        return m_nodes.size() - 1;
+    }
+
+    void run(thread_pool &pool)
+    {
+        m_ready.clear();
+        for (size_t i = 0; i < m_nodes.size(); i++) {
+            m_nodes[i].waiting = m_nodes[i].dependencies;
+            if (m_nodes[i].waiting == 0)
+                m_ready.push_back(i);
+        }
+        m_pending = m_nodes.size();
+        m_error = std::exception_ptr();
+        pool.run(std::min(pool.size(), m_nodes.size()), [this](size_t) { work(); });
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    struct node
+    {
+        std::function<void()> task;
+        std::vector<size_t> next;   // the tasks that depend on this one
+        size_t dependencies;
+        size_t waiting;             // the dependencies not finished yet
+    };
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            while (m_ready.empty() && (m_pending > 0) && !m_error)
+                m_changed.wait(lock);
+            if ((m_pending == 0) || m_error) {
+                m_changed.notify_all();
+                return;
+            }
+            size_t i = m_ready.back();
+            m_ready.pop_back();
+            lock.unlock();
+            try {
+                m_nodes[i].task();
+                lock.lock();
+            } catch (...) {
+                lock.lock();
+                if (!m_error)
+                    m_error = std::current_exception();
+                m_changed.notify_all();
+                continue;
+            }
+            for (size_t k = 0; k < m_nodes[i].next.size(); k++) {
+                if (--m_nodes[m_nodes[i].next[k]].waiting == 0)
+                    m_ready.push_back(m_nodes[i].next[k]);
+            }
+            m_pending--;
+            m_changed.notify_all();
+        }
+    }
+
+    std::vector<node> m_nodes;
+    std::vector<size_t> m_ready;
+    size_t m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::exception_ptr m_error;
+};
+
+
+/* this function splits the rows [0, nrows) into "blocks" contiguous ranges
+   and returns the range [begin, end) of block "index".
+ */
+inline void block_range(size_t nrows, size_t blocks, size_t index, size_t &begin, size_t &end)
+{
+    begin = nrows * index / blocks;
+    end = nrows * (index + 1) / blocks;
+}
+
+
+// this function advances a row iterator by n rows
+template<class I>
+I advance_rows(I row, size_t n)
+{
+    for ( ; n > 0; n--)
+        ++row;
+    return row;
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef RUNNING_FILTERS_HPP
+#define RUNNING_FILTERS_HPP
+
+#include "gamera.hpp"
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Running Extremum =======================
+// the operations of the running extremum, with the value that leaves any pixel unchanged
+template<class V>
+struct running_max
+{
+    V identity() const { return std::numeric_limits<V>::lowest(); }
+    V operator()(V a, V b) const { return (a < b) ? b : a; }
+};
+
+
+template<class V>
+struct running_min
+{
+    V identity() const { return std::numeric_limits<V>::max(); }
+    V operator()(V a, V b) const { return (b < a) ? b : a; }
+};
+
+
+/* the van Herk/Gil-Werman running extremum over windows of k=2h+1 lines.
+   "line" holds n+2h lines of "width" values, padded with h lines of the
+   identity at both ends; line i of "out" gets the extremum of lines
+   i ... i+2h, value by value.
+ * the lines are cut into blocks of k: "forward" holds the extremum from
+   the start of the block and "backward" the extremum to its end, so each
+   window is one value of each, and each value costs three operations
+   whatever the window size. "forward" and "backward" hold n+2h lines.
+ * the inner loops run over the "width" values of a line, so a vertical
+   pass (width = ncols) is one vector operation per line.
+ */
+template<class V, class Op>
+void running_extremum(const V* line, size_t n, size_t h, size_t width,
+                      V* forward, V* backward, V* out, const Op &op)
+{
+    size_t k = 2 * h + 1;
+    size_t m = n + 2 * h;
+    for (size_t i = 0; i < m; ++i) {
+        const V* src = line + i * width;
+        V* f = forward + i * width;
+        if (i % k == 0) {
+            std::copy(src, src + width, f);
+        } else {
+            const V* previous = f - width;
+            for (size_t x = 0; x < width; ++x)
+                f[x] = op(previous[x], src[x]);
+        }
+    }
+    for (size_t i = m; i > 0; --i) {
+        const V* src = line + (i - 1) * width;
+        V* b = backward + (i - 1) * width;
+        if ((i % k == 0) || (i == m)) {
+            std::copy(src, src + width, b);
+        } else {
+            const V* next = b + width;
+            for (size_t x = 0; x < width; ++x)
+                b[x] = op(next[x], src[x]);
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        const V* b = backward + i * width;
+        const V* f = forward + (i + k - 1) * width;
+        V* o = out + i * width;
+        for (size_t x = 0; x < width; ++x)
+            o[x] = op(b[x], f[x]);
+    }
+}
+
+
+/* this function computes the extremum of each pixel over the square of
+   (2*radius+1)^2 pixels around it, clipped at the image border: a pass
+   along the rows, then one along the columns.
+ */
+template<class T, class Op>
+typename ImageFactory<T>::view_type* extremum_filter(const T &src, size_t radius, const Op &op)
+{
+    typedef typename ImageFactory<T>::data_type data_type;
+    typedef typename ImageFactory<T>::view_type view_type;
+    typedef typename T::value_type value_type;
+
+    size_t ncols = src.ncols();
+    size_t nrows = src.nrows();
+    size_t h = radius;
+    data_type* data = new data_type(src.size(), src.origin());
+    view_type* view = new view_type(*data);
+    try {
+        // the rows after the horizontal pass, with h rows of padding above and below
+        vector<value_type> rows((nrows + 2 * h) * ncols, op.identity());
+        vector<value_type> line(ncols + 2 * h, op.identity());
+        vector<value_type> forward(std::max(ncols + 2 * h, (nrows + 2 * h) * ncols));
+        vector<value_type> backward(forward.size());
+
+        typename T::const_row_iterator row = src.row_begin();
+        for (size_t y = 0; y < nrows; ++y, ++row) {
+            size_t x = h;
+            for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x)
+                line[x] = *col;
+            running_extremum(&line[0], ncols, h, 1, &forward[0], &backward[0], &rows[(y + h) * ncols], op);
+        }
+
+        vector<value_type> out(nrows * ncols);
+        running_extremum(&rows[0], nrows, h, ncols, &forward[0], &backward[0], &out[0], op);
+
+        typename view_type::row_iterator out_row = view->row_begin();
+        for (size_t y = 0; y < nrows; ++y, ++out_row) {
+            const value_type* values = &out[y * ncols];
+            for (typename view_type::row_iterator::iterator col = out_row.begin(); col != out_row.end(); ++col, ++values)
+                *col = *values;
+        }
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
+    return view;
+}
+
+
+/* this function dilates (direction 0) or erodes (direction 1) a greyscale
+   image with a square of (2*times+1)^2 pixels, with the same result as
+   Gamera's "erode_dilate(src, times, direction, 0)": the square is clipped
+   at the image border, and images smaller than 3x3 are copied. The cost
+   per pixel does not depend on "times".
+ */
+template<class T>
+typename ImageFactory<T>::view_type* erode_dilate_square(const T &src, size_t times, int direction)
+{
+    typedef typename T::value_type value_type;
+
+    if ((src.nrows() < 3) || (src.ncols() < 3))
+        times = 0;
+    if (direction == 0)
+        return extremum_filter(src, times, running_max<value_type>());
+    return extremum_filter(src, times, running_min<value_type>());
+}
+
+
+// ===================== Running Mean =======================
+/* this function computes the mean of each pixel over the region of
+   region_size^2 pixels around it, clipped at the image border, with the
+   same result as Gamera's "mean_filter" for integer pixels.
+ * the sums of the columns of the window are updated as the window moves
+   down, one row in and one row out, and each row of means is a running sum
+   over the column sums, so the cost per pixel does not depend on
+   "region_size". The sums of integer pixels are exact in double precision.
+ */
+template<class T>
+FloatImageView* box_mean(const T &src, size_t region_size)
+{
+    if ((region_size < 1) || (region_size > std::min(src.nrows(), src.ncols())))
+        throw std::out_of_range("box_mean: region_size out of range");
+
+    size_t ncols = src.ncols();
+    size_t nrows = src.nrows();
+    size_t h = region_size / 2;
+    FloatImageData* data = new FloatImageData(src.size(), src.origin());
+    FloatImageView* view = new FloatImageView(*data);
+    try {
+        vector<double> sums(ncols, 0.0);
+        typename T::const_row_iterator enter = src.row_begin();
+        typename T::const_row_iterator leave = src.row_begin();
+        size_t entered = 0;     // the rows [left, entered) are in the column sums
+        size_t left = 0;
+        FloatImageView::row_iterator out_row = view->row_begin();
+        for (size_t y = 0; y < nrows; ++y, ++out_row) {
+            for (; entered < std::min(y + h + 1, nrows); ++entered, ++enter) {
+                size_t x = 0;
+                for (typename T::const_row_iterator::iterator col = enter.begin(); col != enter.end(); ++col, ++x)
+                    sums[x] += *col;
+            }
+            for (; left + h < y; ++left, ++leave) {
+                size_t x = 0;
+                for (typename T::const_row_iterator::iterator col = leave.begin(); col != leave.end(); ++col, ++x)
+                    sums[x] -= *col;
+            }
+
+            double window_rows = (double)(entered - left);
+            double sum = 0.0;
+            size_t x1 = 0;          // the columns [x0, x1) are in "sum"
+            size_t x0 = 0;
+            FloatImageView::row_iterator::iterator out_col = out_row.begin();
+            for (size_t x = 0; x < ncols; ++x, ++out_col) {
+                for (; x1 < std::min(x + h + 1, ncols); ++x1)
+                    sum += sums[x1];
+                for (; x0 + h < x; ++x0)
+                    sum -= sums[x0];
+                *out_col = (FloatPixel)(sum / ((double)(x1 - x0) * window_rows));
+            }
+        }
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
+    return view;
+}
+
+#endif
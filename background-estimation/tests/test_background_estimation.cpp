@@ -0,0 +1,272 @@
+/* checks of the background estimation and binarization plugins against
+   the results they must reproduce.
+
+   build with the Gamera and Python headers, from this directory:
+     g++ -O2 -pthread -I../include/plugins -I<gamera>/include \
+         -I<python>/include test_background_estimation.cpp -lpython<version> \
+         -o test_background_estimation
+   and run ./test_background_estimation; it prints the failed checks and
+   returns their number.
+ */
+#include "background_estimation.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace Gamera;
+using namespace std;
+
+static int failures=0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+
+template<class T>
+void delete_view(T* view)
+{
+  delete view->data();
+  delete view;
+}
+
+
+// a page with a smooth background, darker strokes and some noise
+template<class T>
+void make_page(T &page, unsigned int seed, int scale=1)
+{
+  srand(seed);
+  for (size_t y=0; y<page.nrows(); y++) {
+    for (size_t x=0; x<page.ncols(); x++) {
+      int value=150+(int)(30*sin(x*0.05))+rand()%20;
+      if ((((x/7)%5==0) && ((y/11)%3==0)) || (rand()%50==0))
+        value=60+rand()%60;
+      page.set(Point(x, y), (typename T::value_type)(max(0, min(255, value))*scale));
+    }
+  }
+}
+
+
+template<class T>
+void make_mask(T &mask)
+{
+  size_t ncols=mask.ncols();
+  size_t nrows=mask.nrows();
+  for (size_t y=0; y<nrows; y++)
+    for (size_t x=0; x<ncols; x++)
+      mask.set(Point(x, y), ((x>ncols/8) && (x<ncols*7/8) && (y>nrows/10) && (y<nrows*9/10)) ? 1 : 0);
+}
+
+
+/* a GREY16 page whose levels are those of a GREYSCALE page times 257 is
+   equalised to the GREYSCALE result times 257, so the top reference level
+   maps to 65535.
+ */
+void test_equalise_grey16()
+{
+  FloatVector reference(256);
+  for (size_t k=0; k<reference.size(); k++)
+    reference[k]=1.0+k%7;
+  GreyScaleImageData grey_data(Dim(120, 90));
+  GreyScaleImageView grey(grey_data);
+  make_page(grey, 1);
+  Grey16ImageData grey16_data(Dim(120, 90));
+  Grey16ImageView grey16(grey16_data);
+  make_page(grey16, 1, 257);
+  OneBitImageData mask_data(Dim(120, 90));
+  OneBitImageView mask(mask_data);
+  make_mask(mask);
+
+  GreyScaleImageView* equalised=(GreyScaleImageView*)equalise_histogram_mask(grey, mask, &reference);
+  Grey16ImageView* equalised16=(Grey16ImageView*)equalise_histogram_mask(grey16, mask, &reference);
+  size_t different=0;
+  Grey16Pixel top=0;
+  for (size_t y=0; y<grey.nrows(); y++) {
+    for (size_t x=0; x<grey.ncols(); x++) {
+      Grey16Pixel value=equalised16->get(Point(x, y));
+      different+=(value!=equalised->get(Point(x, y))*257);
+      top=max(top, value);
+    }
+  }
+  CHECK(different==0);
+  CHECK(top==65535);
+  delete_view(equalised);
+  delete_view(equalised16);
+}
+
+
+/* binarization of a page through the whole-page stages, for comparison:
+   the noise variance is estimated over the page as "binarization" does.
+ */
+template<class T, class U>
+OneBitImageView* binarization_whole_page(const T &src, const U &mask, reference_histogram &reference,
+                                         int sign_wiener, double noise_variance, size_t med_size, int pyramid_levels)
+{
+  if ((sign_wiener==1) && (noise_variance<=0)) {
+    double noise_sum=0;
+    size_t noise_samples=0;
+    wiener_noise_sum(src, 5, 3, 1, 0, 0, src.ncols(), src.nrows(), noise_sum, noise_samples);
+    noise_variance=noise_sum/noise_samples;
+  }
+  OneBitImageData* data=new OneBitImageData(src.size(), src.origin());
+  OneBitImageView* result=new OneBitImageView(*data);
+  binarization_arena arena(2);
+  binarization_stages(src, mask, reference, src.ncols()*src.nrows(),
+                      sign_wiener, 5, 3, noise_variance,
+                      med_size, pyramid_factor(src.ncols(), src.nrows(), med_size, pyramid_levels),
+                      15, 0.5, 128, 20, 150, 0.06, 0.7, 0.5,
+                      *result, arena);
+  return result;
+}
+
+
+/* "binarization" only processes the region around the mask, and gives the
+   result of the whole page: the mask is a part of the page, with a dark
+   band across its border, and some masks have pixels of value 2, which
+   the equalization does not count.
+ */
+void test_binarization_region()
+{
+  FloatVector histogram(256);
+  for (size_t k=0; k<histogram.size(); k++)
+    histogram[k]=(k<100) ? 1.0 : 8.0;
+  reference_histogram reference(histogram);
+  for (int run=0; run<24; run++) {
+    srand(100+run);
+    size_t ncols=120+rand()%120;
+    size_t nrows=100+rand()%120;
+    GreyScaleImageData page_data(Dim(ncols, nrows));
+    GreyScaleImageView page(page_data);
+    make_page(page, run);
+    OneBitImageData mask_data(Dim(ncols, nrows));
+    OneBitImageView mask(mask_data);
+    size_t x0=rand()%(ncols/2);
+    size_t y0=rand()%(nrows/2);
+    size_t x1=x0+20+rand()%(ncols-x0-20);
+    size_t y1=y0+20+rand()%(nrows-y0-20);
+    for (size_t y=y0; y<y1; y++)
+      for (size_t x=x0; x<x1; x++)
+        mask.set(Point(x, y), (rand()%7!=0) ? 1 : (run%5==0) ? 2 : 0);
+    for (size_t y=y0; y<nrows; y++)
+      for (size_t x=x1-10; x<min(x1+30, ncols); x++)
+        page.set(Point(x, y), page.get(Point(x, y))/3);
+
+    int sign_wiener=run%2;
+    double noise_variance=(run%4<2) ? -1.0 : 40.0;
+    size_t med_size=(run%3==0) ? 9 : 21;
+    int pyramid_levels=(run%6<3) ? 0 : 2;
+    binarization_arena arena(1+run%3);
+    OneBitImageView* region=binarization(page, mask, reference,
+                                         sign_wiener, 5, 3, noise_variance,
+                                         med_size, pyramid_levels, 0,
+                                         15, 0.5, 128, 20, 150, 0.06, 0.7, 0.5,
+                                         arena);
+    OneBitImageView* whole=binarization_whole_page(page, mask, reference, sign_wiener, noise_variance,
+                                                   med_size, pyramid_levels);
+    size_t different=0;
+    for (size_t y=0; y<nrows; y++)
+      for (size_t x=0; x<ncols; x++)
+        different+=(region->get(Point(x, y))!=whole->get(Point(x, y)));
+    CHECK(different==0);
+    delete_view(region);
+    delete_view(whole);
+  }
+}
+
+
+/* the number of pixels where the binarization of "page" in tiles, smaller
+   and larger than the filter regions, differs from the page binarized at
+   once.
+ */
+template<class T>
+size_t tiled_differences(const T &page, const OneBitImageView &mask, reference_histogram &reference,
+                         int sign_wiener, int pyramid_levels, binarization_arena &arena)
+{
+  OneBitImageView* whole=binarization(page, mask, reference,
+                                      sign_wiener, 5, 3, -1.0,
+                                      17, pyramid_levels, 0,
+                                      15, 0.5, 128, 20, 150, 0.01, 0.7, 0.5,
+                                      arena);
+  size_t different=0;
+  size_t tile_sizes[]={16, 40, 100, 1000};
+  for (size_t k=0; k<sizeof(tile_sizes)/sizeof(tile_sizes[0]); k++) {
+    OneBitImageView* tiled=binarization(page, mask, reference,
+                                        sign_wiener, 5, 3, -1.0,
+                                        17, pyramid_levels, tile_sizes[k],
+                                        15, 0.5, 128, 20, 150, 0.01, 0.7, 0.5,
+                                        arena);
+    for (size_t y=0; y<page.nrows(); y++)
+      for (size_t x=0; x<page.ncols(); x++)
+        different+=(tiled->get(Point(x, y))!=whole->get(Point(x, y)));
+    delete_view(tiled);
+  }
+  delete_view(whole);
+  return different;
+}
+
+
+/* tiled binarization gives the result of the page binarized at once, with
+   the Wiener filter and its noise estimate and with one to three pyramid
+   levels, and refuses tiles without pyramid levels. The levels of FLOAT
+   pages are stretched over the whole page, so a bright spot in one tile
+   changes the other tiles alike.
+ */
+void test_binarization_tiles()
+{
+  FloatVector histogram(256);
+  for (size_t k=0; k<histogram.size(); k++)
+    histogram[k]=(k<100) ? 1.0 : 8.0;
+  reference_histogram reference(histogram);
+  binarization_arena arena(3);
+  for (int run=0; run<8; run++) {
+    size_t ncols=160+run*53;
+    size_t nrows=140+run*37;
+    OneBitImageData mask_data(Dim(ncols, nrows));
+    OneBitImageView mask(mask_data);
+    make_mask(mask);
+    int sign_wiener=run%2;
+    int pyramid_levels=1+run%3;
+
+    GreyScaleImageData page_data(Dim(ncols, nrows));
+    GreyScaleImageView page(page_data);
+    make_page(page, run);
+    CHECK(tiled_differences(page, mask, reference, sign_wiener, pyramid_levels, arena)==0);
+
+    FloatImageData float_data(Dim(ncols, nrows));
+    FloatImageView float_page(float_data);
+    make_page(float_page, run);
+    float_page.set(Point(ncols*3/4, nrows*3/4), 1000.0);
+    CHECK(tiled_differences(float_page, mask, reference, sign_wiener, pyramid_levels, arena)==0);
+  }
+
+  GreyScaleImageData page_data(Dim(160, 140));
+  GreyScaleImageView page(page_data);
+  OneBitImageData mask_data(page.size());
+  OneBitImageView mask(mask_data);
+  make_mask(mask);
+  bool thrown=false;
+  try {
+    binarization(page, mask, reference,
+                 0, 5, 3, -1.0,
+                 17, 0, 40,
+                 15, 0.5, 128, 20, 150, 0.01, 0.7, 0.5,
+                 arena);
+  } catch (std::invalid_argument &e) {
+    thrown=true;
+  }
+  CHECK(thrown);
+}
+
+
+int main()
+{
+  test_equalise_grey16();
+  test_binarization_region();
+  test_binarization_tiles();
+  printf("%d failed checks\n", failures);
+  return failures;
+}
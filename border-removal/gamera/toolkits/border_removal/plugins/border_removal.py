@@ -19,12 +19,11 @@
 
 
 # TODO: Add GREY16 compatibility.
-# TODO: Add 8 connectivity to flood_fill_holes_grey and flood_fill_bw.
 
 """border removal tools."""
 
 from gamera.plugin import PluginFunction, PluginModule
-from gamera.args import Args, ImageType, Int, Real
+from gamera.args import Args, ImageType, Int, Real, String, Class
 from gamera.enums import FLOAT, GREYSCALE, GREY16, ONEBIT
 import _border_removal
 
@@ -49,6 +48,31 @@ class med_filter(PluginFunction):
     __call__ = staticmethod(__call__)
 
 
+class median_filter(PluginFunction):
+    """
+    Returns the regional intermediate value of an image, in the pixel type
+    of the image.
+
+    Gives the same values as med_filter, but uses a sliding histogram
+    (Perreault and Hebert for GREYSCALE, Huang for GREY16), so the cost per
+    pixel does not depend on the region size.
+
+    *region_size*
+      The size of the region within which to calculate the intermediate pixel value.
+    """
+    return_type = ImageType([GREYSCALE, GREY16], "output")
+    self_type = ImageType([GREYSCALE, GREY16])
+    args = Args([Int("region size", default=5)])
+    doc_examples = [(GREYSCALE,), (GREY16,)]
+    category = "Border Removal"
+    author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
+    url = "http://ddmal.music.mcgill.ca/"
+
+    def __call__(self, region_size=5):
+        return _border_removal.median_filter(self, region_size)
+    __call__ = staticmethod(__call__)
+
+
 class flood_fill_holes_grey(PluginFunction):
     """
     Fills holes in an image by flood fill.
@@ -58,15 +82,19 @@ class flood_fill_holes_grey(PluginFunction):
     on Image Processing, vol.2, no.2, April 1993, pp. 176-201
 
     Note: this function only works on greyscale image.
+
+    *connectivity*
+      4 or 8, the neighbourhood used to connect the pixels.
     """
     self_type = ImageType([GREYSCALE])
     return_type = ImageType([GREYSCALE], "output")
+    args = Args([Int("connectivity", default=4)])
     category = "Border Removal"
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
     url = "http://ddmal.music.mcgill.ca/"
 
-    def __call__(self):
-        return _border_removal.flood_fill_holes_grey(self)
+    def __call__(self, connectivity=4):
+        return _border_removal.flood_fill_holes_grey(self, connectivity)
     __call__ = staticmethod(__call__)
 
 
@@ -79,15 +107,19 @@ class flood_fill_bw(PluginFunction):
     Algorithm reference: Luc Vincent, "Morphological Grayscale Reconstruction
     In Image Analysis: Applications and Efficient Algorithms", IEEE Transactions
     on Image Processing, vol.2, no.2, April 1993, pp. 176-201
+
+    *connectivity*
+      4 or 8, the neighbourhood used to connect the pixels.
     """
     self_type = ImageType([ONEBIT])
     return_type = ImageType([ONEBIT], "output")
+    args = Args([Int("connectivity", default=4)])
     category = "Border Removal"
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
     url = "http://ddmal.music.mcgill.ca/"
 
-    def __call__(self):
-        return _border_removal.flood_fill_bw(self)
+    def __call__(self, connectivity=4):
+        return _border_removal.flood_fill_bw(self, connectivity)
     __call__ = staticmethod(__call__)
 
 
@@ -192,6 +224,11 @@ class boundary_reconstruct(PluginFunction):
 
     *interval3*
         interval for edge adding in 3rd round.
+
+    *speculative*
+        if not 0, the three rounds run at once on several threads. A round
+        that succeeds cancels the rounds after it, and the mask is the same
+        as when the rounds run one after another.
     """
     category = "Border Removal"
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
@@ -202,14 +239,15 @@ class boundary_reconstruct(PluginFunction):
                  Int("terminate_time2", default=23),
                  Int("terminate_time3", default=75),
                  Int("interval2", default=45),
-                 Int("interval3", default=15)])
+                 Int("interval3", default=15),
+                 Int("speculative", default=0)])
 
     def __call__(self,
                  terminate_time1=15, terminate_time2=23, terminate_time3=75,
-                 interval2=45, interval3=15):
+                 interval2=45, interval3=15, speculative=0):
         return _border_removal.boundary_reconstruct(self,
                                                     terminate_time1, terminate_time2, terminate_time3,
-                                                    interval2, interval3)
+                                                    interval2, interval3, speculative)
     __call__ = staticmethod(__call__)
 
 
@@ -218,6 +256,10 @@ class border_removal(PluginFunction):
     Returns the mask of music score region.
 
     Gathers paper_estimation, edge_detection and boundary_reconstruct functions.
+
+    *speculative*
+        if not 0, the rounds of boundary_reconstruct run at once on several
+        threads; the mask is the same.
     """
     category = "Border Removal"
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
@@ -236,7 +278,8 @@ class border_removal(PluginFunction):
                  Int("terminate_time2", default=23),
                  Int("terminate_time3", default=75),
                  Int("interval2", default=45),
-                 Int("interval3", default=15)])
+                 Int("interval3", default=15),
+                 Int("speculative", default=0)])
 
     def __call__(self,
                  win_dil=3, win_avg=5, win_med=5,
@@ -244,27 +287,86 @@ class border_removal(PluginFunction):
                  threshold2_scale=0.8, threshold2_gradient=6.0,
                  transfer_parameter=0.25,
                  terminate_time1=15, terminate_time2=23, terminate_time3=75,
-                 interval2=45, interval3=15):
+                 interval2=45, interval3=15, speculative=0):
         return _border_removal.border_removal(self,
                                               win_dil, win_avg, win_med,
                                               threshold1_scale, threshold1_gradient,
                                               threshold2_scale, threshold2_gradient,
                                               transfer_parameter,
                                               terminate_time1, terminate_time2, terminate_time3,
-                                              interval2, interval3)
+                                              interval2, interval3, speculative)
+    __call__ = staticmethod(__call__)
+
+
+class border_removal_with_accounting(PluginFunction):
+    """
+    Returns the mask of music score region like border_removal, together
+    with the memory allocated by each stage, as the tuple (mask, accounting).
+
+    *accounting*
+        a dict with the page size ("ncols", "nrows"), the bytes allocated for
+        images, the number of allocations and the high-water mark of the
+        bytes held ("bytes", "allocations", "peak"), and the same for each
+        stage under "stages", in the order the stages ran.
+
+    *json_file*
+        if not empty, the accounting is also appended to this file as one
+        line of JSON, so a batch leaves one line per page.
+    """
+    category = "Border Removal"
+    author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
+    url = "http://ddmal.music.mcgill.ca/"
+    return_type = Class("result")
+    self_type = ImageType([GREYSCALE])
+    args = Args([Int("win_dil", default=3),
+                 Int("win_avg", default=5),
+                 Int("win_med", default=5),
+                 Real("threshold1_scale", default=0.8),
+                 Real("threshold1_gradient", default=6.0),
+                 Real("threshold2_scale", default=0.8),
+                 Real("threshold2_gradient", default=6.0),
+                 Real("transfer_parameter", default=0.25),
+                 Int("terminate_time1", default=15),
+                 Int("terminate_time2", default=23),
+                 Int("terminate_time3", default=75),
+                 Int("interval2", default=45),
+                 Int("interval3", default=15),
+                 Int("speculative", default=0),
+                 String("json_file", default="")])
+
+    def __call__(self,
+                 win_dil=3, win_avg=5, win_med=5,
+                 threshold1_scale=0.8, threshold1_gradient=6.0,
+                 threshold2_scale=0.8, threshold2_gradient=6.0,
+                 transfer_parameter=0.25,
+                 terminate_time1=15, terminate_time2=23, terminate_time3=75,
+                 interval2=45, interval3=15, speculative=0,
+                 json_file=""):
+        return _border_removal.border_removal_with_accounting(self,
+                                              win_dil, win_avg, win_med,
+                                              threshold1_scale, threshold1_gradient,
+                                              threshold2_scale, threshold2_gradient,
+                                              transfer_parameter,
+                                              terminate_time1, terminate_time2, terminate_time3,
+                                              interval2, interval3, speculative,
+                                              json_file)
     __call__ = staticmethod(__call__)
 
 
 class BorderRemovalGenerator(PluginModule):
     category = "Border Removal"
     cpp_headers = ["border_removal.hpp"]
+    extra_compile_args = ["-pthread"]
+    extra_link_args = ["-pthread"]
     functions = [med_filter,
+                 median_filter,
                  flood_fill_holes_grey,
                  flood_fill_bw,
                  paper_estimation,
                  edge_detection,
                  boundary_reconstruct,
-                 border_removal]
+                 border_removal,
+                 border_removal_with_accounting]
     author = "Yue Phyllis Ouyang and John Ashley Burgoyne"
     url = "http://ddmal.music.mcgill.ca/"
 module = BorderRemovalGenerator()
@@ -10,12 +10,20 @@
 #include "plugins/edgedetect.hpp"
 #include "plugins/segmentation.hpp"
 #include "plugins/draw.hpp"
-#include "plugins/thinning.hpp"
 #include "connected_components.hpp"
+#include "median_filter.hpp"
+#include "memory_accounting.hpp"
+#include "reconstruction.hpp"
+#include "packed_rows.hpp"
+#include "packed_morphology.hpp"
+#include "running_filters.hpp"
+#include "resample.hpp"
+#include "parallel.hpp"
 
 #include "math.h"
+#include <climits>
+#include <atomic>
 #include <vector>
-#include <queue>
 #include <numeric>
 #include <algorithm>
 
@@ -23,9 +31,6 @@
 
 
 
-// ====== flood fill ======
-#define MINUS 1
-#define PLUS -1
 // ====== paper estimation ======
 #define SMOOTH 1
 #define DETAIL 0
@@ -56,10 +61,57 @@ FloatPixel image_med(const T &src)
 }
 
 
+/* this function maps the pixels of an image to the ranks of their values
+   among the distinct pixel values ("levels"). The median commutes with this
+   monotone mapping, so the ranks can be filtered by the histogram median.
+ * false is returned when there are more levels than a 16-bit histogram holds.
+ */
+template<class T>
+bool median_levels(const T &src, vector<Grey16Pixel> &ranks, vector<FloatPixel> &levels)
+{
+    typedef typename T::value_type value_type;
+    const size_t bins = median_traits<Grey16Pixel>::bins;
+    typename T::const_vec_iterator it;
+    size_t i;
+
+    if (std::numeric_limits<value_type>::is_integer) {
+        vector<Grey16Pixel> index(bins, 0);
+        for (it = src.vec_begin(); it != src.vec_end(); ++it)
+            index[std::min((size_t)*it, bins - 1)] = 1;
+        levels.clear();
+        for (i = 0; i < bins; ++i) {
+            if (index[i]) {
+                index[i] = levels.size();
+                levels.push_back((FloatPixel)i);
+            }
+        }
+        for (it = src.vec_begin(), i = 0; it != src.vec_end(); ++it, ++i)
+            ranks[i] = index[std::min((size_t)*it, bins - 1)];
+        return true;
+    }
+
+    levels.resize(ranks.size());
+    copy(src.vec_begin(),
+              src.vec_end(),
+              levels.begin());
+    sort(levels.begin(), levels.end());
+    levels.erase(unique(levels.begin(), levels.end()), levels.end());
+    if (levels.size() > bins)
+        return false;
+    for (it = src.vec_begin(), i = 0; it != src.vec_end(); ++it, ++i)
+        ranks[i] = lower_bound(levels.begin(), levels.end(), (FloatPixel)*it) - levels.begin();
+    return true;
+}
+
+
 // main function of median filter
 /* The implementation of region size is not entirely correct because of
    integer rounding but matches the implementation of the thresholding
    algorithms.
+ * the ranks of the pixel values (see "median_levels") are filtered by the
+   sliding histogram median of median_filter.hpp and mapped back to values.
+   Only FLOAT images with more than 65536 distinct values fall back to
+   sorting every region with "image_med".
  */
 template<class T>
 FloatImageView* med_filter(const T &src, size_t region_size)
@@ -69,10 +121,19 @@ FloatImageView* med_filter(const T &src, size_t region_size)
 
     size_t half_region_size = region_size / 2;
 
-    typename ImageFactory<T>::view_type* copy = ImageFactory<T>::new_view(src);
-    FloatImageData* data = new FloatImageData(src.size(), src.origin());
+    FloatImageData* data = account_data(new FloatImageData(src.size(), src.origin()));
     FloatImageView* view = new FloatImageView(*data);
 
+    vector<Grey16Pixel> ranks(src.nrows()*src.ncols());
+    vector<FloatPixel> levels;
+    if (median_levels(src, ranks, levels)) {
+        median_filter_rows(&ranks[0], src.ncols(), src.nrows(), half_region_size, view->row_begin(), levels.size());
+        for (FloatImageView::vec_iterator it = view->vec_begin(); it != view->vec_end(); ++it)
+            *it = levels[(size_t)*it];
+        return view;
+    }
+
+    typename ImageFactory<T>::view_type* copy = ImageFactory<T>::new_view(src);
     for (coord_t y = 0; y < src.nrows(); ++y) {
         for (coord_t x = 0; x < src.ncols(); ++x) {
             // Define the region.
@@ -93,267 +154,118 @@ FloatImageView* med_filter(const T &src, size_t region_size)
 
 // =============== Flood Fill ================
 
-/* this function only implements 4-connectivity. 8-connectivity can be added by assigning new labels.
- * the neighbourhood labels: (x indicates the current pixel)
-                 -1
-              -2  x  2
-                  1
- */
-Point neighbour(Point current, int pos)
-{
-    switch (pos) {
-        case -1:
-          return Point(current.x(), current.y()-1);
-        case -2:
-          return Point(current.x()-1, current.y());
-        case 1:
-          return Point(current.x(), current.y()+1);
-        case 2:
-          return Point(current.x()+1, current.y());
-        default:
-          return current;
-    }
-}
-
-
-/* this function returns the nth neighbour position of current pixel along raster scanning or anti-raster scanning
- * "sequence" indicates the kind of scannig, PLUS as raster and MINUS as anti-raster
- * when "nth" is invalid, the current pixel is returned
- *
- * the nth-neighbour labels: (x indicates the current pixel)
-   raster:                 anti-raster:
-                 1                        x  2
-              2  x                        1
- *
- * this function only implements 4-connectivity. 8-connectivity can be added by assigning new labels.
- */
-template<class T>
-Point neighbour_nth(const T &src, Point current, int nth, int sequence)
-{
-    int nth_max=2;      // the maximum number of neighbours in scanning
-    int shift=0;        // label shifting when the current pixel is on the image border
-
-    // raster scanning
-    if (sequence==PLUS) {
-        if (current.y()==0) { // first row
-            nth_max--;
-            shift++;
-        }
-        if (current.x()==0)   // first column
-            nth_max--;
-    }
-    // anti-raster scanning
-    else {
-        if (current.y()==src.nrows()-1) {   // last row
-            nth_max--;
-            shift++;
-            }
-        if (current.x()==src.ncols()-1) {   // last column
-            nth_max--;
-        }
-    }
-    if (nth>nth_max||nth==0)   // when "nth" is invalid, return the current position
-        return current;
-    else {
-        return neighbour(current, sequence*(nth+shift));
-        }
-}
-
-
 /* this function creates mask image for filling holes approach, and it only works for greyscale image
  */
 template<class T>
 typename ImageFactory<T>::view_type* flood_mask_grey(const T &src)
 {
-        typename ImageFactory<T>::view_type* mask_view = pad_image(src, 1, 1, 1, 1, 0);
+        typename ImageFactory<T>::view_type* mask_view = account_image(pad_image(src, 1, 1, 1, 1, 0));
         invert(*mask_view);
         return mask_view;
 }
 
 
 /* this function creates marker image for filling holes approach, and it only works for greyscale image
+ * the border is white, so GREY16 images are filled over their whole range.
  */
 template<class T>
 typename ImageFactory<T>::view_type* flood_marker_grey(const T &src)
 {
-    typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
+    typename ImageFactory<T>::data_type* data = account_data(new typename ImageFactory<T>::data_type(src.size(), src.origin()));
     typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
         invert(*view);
-        typename ImageFactory<T>::view_type* marker_view = pad_image(*view, 1, 1, 1, 1, 255);
-        delete data;
-        delete view;
+        typename ImageFactory<T>::view_type* marker_view = account_image(pad_image(*view, 1, 1, 1, 1, white(*view)));
+        release_image(view);
         return marker_view;
 }
 
 
-/* this function creates mask image for flood fill approach, and it only works for binary image
+// greyscale reconstruction, the core function of both flood fill and filling holes.
+/* "conn" is the connectivity, 4 or 8. The reconstruction runs on guarded
+   copies of the two images (see "reconstruct" in reconstruction.hpp).
  */
 template<class T>
-typename ImageFactory<T>::view_type* flood_mask_bw(const T &src)
+void flood_fill_core(const T &mask, T &marker, int conn=4)
 {
-    typename ImageFactory<T>::view_type* mask_view = pad_image(src, 1, 1, 1, 1, 0);
-    invert(*mask_view);
-    return mask_view;
+    reconstruct(mask, marker, conn);
 }
 
 
-/* this function creates marker image for flood fill approach, and it only works for binary image
- */
+// the same reconstruction by bands of rows on "pool"
 template<class T>
-typename ImageFactory<T>::view_type* flood_marker_bw(const T &src)
+void flood_fill_core(const T &mask, T &marker, int conn, thread_pool &pool)
 {
-    typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
-    typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
-    typename ImageFactory<T>::view_type* marker_view = pad_image(*view, 1, 1, 1, 1, 1);
-    return marker_view;
-}
-
-
-// greyscale reconstruction, the core function of both flood fill and filling holes.
-/*  Algorithm reference: Luc Vincent, "Morphological Grayscale Reconstruction
-    In Image Analysis: Applications and Efficient Algorithms", IEEE Transactions
-    on Image Processing, vol.2, no.2, April 1993, pp. 176-201
- * this function works on both 4-connectivity and 8-connectivity, but "neighbour_nth" and "neighbour" functions should be revised in case of 8-connectivity.
- */
-template<class T>
-void flood_fill_core(const T &mask, T &marker, int conn=4)
-{
-    Point p,q,p2;
-    typename T::value_type max_pixel, value;
-    queue<Point> queue_fifo;
-
-    // raster scanning
-    for (p=Point(0,0); p.y()<marker.nrows(); p.move(0,1)) {
-        for (p.x(0); p.x()<marker.ncols(); p.move(1,0)) {
-            max_pixel=marker.get(p);
-            for (int walker=1; walker<=conn/2; walker++) {
-                q=neighbour_nth(marker, p, walker, PLUS);
-                if (marker.get(q)>max_pixel)
-                    max_pixel=marker.get(q);
-            }
-            value=(max_pixel<(mask.get(p))) ? max_pixel : mask.get(p);
-            marker.set(p,value);
-        }
-    }
-
-// anti-raster scanning - AH refactor
-    p = Point(marker.ncols() - 1, marker.nrows() - 1);
-    while ( p.y() )
-    {
-        while ( p.x() )
-        {
-            max_pixel = marker.get(p);
-            for ( int walker = 1; walker <= (conn / 2); walker++)
-            {
-                q = neighbour_nth(marker, p, walker, MINUS);
-                if ( marker.get(q) > max_pixel )
-                {
-                    max_pixel = marker.get(q);
-                }
-            }
-            value = (max_pixel < (mask.get(p))) ? max_pixel : mask.get(p);
-            marker.set(p, value);
-            for ( int walker = 1; walker <= (conn / 2); walker++ )
-            {
-                q = neighbour_nth(marker, p, walker, MINUS);
-                if (q == p)
-                {
-                    continue;
-                }
-                if ( (marker.get(q) < marker.get(p)) && (marker.get(q) < mask.get(q)) ) {
-                    queue_fifo.push(p);
-                    break;
-                }
-            }
-            p.move(-1, 0);
-        }
-        p.move(0, -1);
-    }
-
-    // propagation
-    while (!queue_fifo.empty()) {
-        p=queue_fifo.front();
-        queue_fifo.pop();
-        // traverse all neighbours by raster and anti-raster scanning
-        for (int walker=1; walker<=conn/2; walker++) {
-            q=neighbour_nth(marker, p, walker, PLUS);
-            if (q==p)
-                continue;
-            if ((marker.get(q)<marker.get(p))&&(marker.get(q)!=mask.get(q))) {
-                value=(marker.get(p)<mask.get(q)) ? marker.get(p) : mask.get(q);
-                marker.set(q,value);
-                queue_fifo.push(q);
-            }
-        }
-        for (int walker=1; walker<=conn/2; walker++) {
-            q=neighbour_nth(marker, p, walker, MINUS);
-            if (q==p)
-                continue;
-            if ((marker.get(q)<marker.get(p))&&(marker.get(q)!=mask.get(q))) {
-                value=(marker.get(p)<mask.get(q)) ? marker.get(p) : mask.get(q);
-                marker.set(q,value);
-                queue_fifo.push(q);
-            }
-        }
-    }
+    reconstruct(mask, marker, conn, pool);
 }
 
 
 // main function for filling holes
 /* it only works on greyscale images.
- * this function works on both 4-connectivity and 8-connectivity, but "neighbour_nth" and "neighbour" functions should be revised in case of 8-connectivity.
+ * "conn" is the connectivity, 4 or 8.
+ * the reconstruction runs on "pool"; the result does not depend on the
+   number of threads.
  */
 template<class T>
-typename ImageFactory<T>::view_type* flood_fill_holes_grey(const T &src, int conn=4)
+typename ImageFactory<T>::view_type* flood_fill_holes_grey(const T &src, int conn, thread_pool &pool)
 {
     // create mask and marker images
     typename ImageFactory<T>::view_type* mask = flood_mask_grey(src);
     typename ImageFactory<T>::view_type* marker = flood_marker_grey(src);
     // flood fill
-    flood_fill_core(*mask, *marker, conn);
+    flood_fill_core(*mask, *marker, conn, pool);
     invert(*marker);
     // extract the central region because of the padding process during mask and marker process
     marker->rect_set(Point(1, 1), Size((marker->size()).width()-2, (marker->size()).height()-2));
-    typename ImageFactory<T>::view_type* result=simple_image_copy(*marker);
+    typename ImageFactory<T>::view_type* result=account_image(simple_image_copy(*marker));
     result->move(-1, -1);
     (result->data())->page_offset_x(0);
     (result->data())->page_offset_y(0);
 
-    delete mask->data();
-    delete mask;
-    delete marker->data();
-    delete marker;
+    release_image(mask);
+    release_image(marker);
     return result;
 }
 
 
+template<class T>
+typename ImageFactory<T>::view_type* flood_fill_holes_grey(const T &src, int conn=4)
+{
+    thread_pool pool(1);
+    return flood_fill_holes_grey(src, conn, pool);
+}
+
+
 // main function for flood fill
 /* it only works on binary images.
- * this function works on both 4-connectivity and 8-connectivity, but "neighbour_nth" and "neighbour" functions should be revised in case of 8-connectivity.
+ * "conn" is the connectivity, 4 or 8.
+ * the result is black except for the white regions that are not connected
+   to the border of the image. The fill works on packed rows (see
+   "reconstruct_from_border"), without padding the image.
  */
 template<class T>
 typename ImageFactory<T>::view_type* flood_fill_bw(const T &src, int conn=4)
 {
-    // create mask and marker images
-    typename ImageFactory<T>::view_type* mask = flood_mask_bw(src);
-    typename ImageFactory<T>::view_type* marker = flood_marker_bw(src);
-    // flood fill
-    flood_fill_core(*mask, *marker, conn);
-    invert(*mask);
-    // extract the central region because of the padding process during mask and marker process
-    typename ImageFactory<T>::view_type* marker2=or_image(*mask, *marker, false);
-    marker2->rect_set(Point(1, 1), Size((marker2->size()).width()-2, (marker2->size()).height()-2));
-    typename ImageFactory<T>::view_type* result=simple_image_copy(*marker2);
-    result->move(-1, -1);
-    (result->data())->page_offset_x(0);
-    (result->data())->page_offset_y(0);
+    packed_image background, reached;
+    pack_rows(src, background, false);
+    account_bytes(2 * background.bytes());
+    try {
+        reconstruct_from_border(background, reached, conn);
+    } catch (std::exception e) {
+        release_bytes(2 * background.bytes());
+        throw;
+    }
 
-    delete mask->data();
-    delete mask;
-    delete marker->data();
-    delete marker;
-    delete marker2->data();
-    delete marker2;
+    // the holes are the background that was not reached
+    for (size_t y = 0; y < background.nrows(); ++y) {
+        packed_word* holes = background.row(y);
+        const packed_word* outside = reached.row(y);
+        for (size_t w = 0; w < background.words(); ++w)
+            holes[w] &= ~outside[w];
+    }
+    typename ImageFactory<T>::data_type* data = account_data(new typename ImageFactory<T>::data_type(src.size(), src.origin()));
+    typename ImageFactory<T>::view_type* result = new typename ImageFactory<T>::view_type(*data);
+    unpack_rows(background, *result, false);
+    release_bytes(2 * background.bytes());
     return result;
 }
 
@@ -374,11 +286,14 @@ typename ImageFactory<T>::view_type* flood_fill_bw(const T &src, int conn=4)
 
     *med_win*
         region size for median filter.
+
+ * the filling holes steps run on "pool".
  */
 template<class T>
-GreyScaleImageView* paper_estimation(const T &src, int sign, int win_dil, int win_avg, int win_med)
+GreyScaleImageView* paper_estimation(const T &src, int sign, int win_dil, int win_avg, int win_med,
+                                     thread_pool &pool)
 {
-    GreyScaleImageData* copy_data = new GreyScaleImageData(src.size(), src.origin());
+    GreyScaleImageData* copy_data = account_data(new GreyScaleImageData(src.size(), src.origin()));
     GreyScaleImageView* copy_view = new GreyScaleImageView(*copy_data);
     copy(src.vec_begin(),
               src.vec_end(),
@@ -388,50 +303,50 @@ GreyScaleImageView* paper_estimation(const T &src, int sign, int win_dil, int wi
     GreyScaleImageView* image_morph1;
     GreyScaleImageView* image_morph2;
     if (sign==SMOOTH) {
-        image_morph1=erode_dilate(*copy_view, win_dil, 1, 0);
-        delete copy_data;
-        delete copy_view;
-        image_morph2=erode_dilate(*image_morph1, win_dil, 0, 0);
-        delete image_morph1->data();
-        delete image_morph1;
+        image_morph1=account_image(erode_dilate_square(*copy_view, win_dil, 1));
+        release_image(copy_view);
+        image_morph2=account_image(erode_dilate_square(*image_morph1, win_dil, 0));
+        release_image(image_morph1);
         }
     else
         image_morph2=copy_view;
 
     // blurring
         // filling holes
-    GreyScaleImageView* image_fill=flood_fill_holes_grey(*image_morph2);
-    delete image_morph2->data();
-    delete image_morph2;
+    GreyScaleImageView* image_fill=flood_fill_holes_grey(*image_morph2, 4, pool);
+    release_image(image_morph2);
         // mean (average) filter
-    FloatImageView* image_avg=mean_filter(*image_fill, win_avg);
-    delete image_fill->data();
-    delete image_fill;
+    FloatImageView* image_avg=account_image(box_mean(*image_fill, win_avg));
+    release_image(image_fill);
         // median filter
     FloatImageView* image_med=med_filter(*image_avg, win_med);
-    delete image_avg->data();
-    delete image_avg;
+    release_image(image_avg);
 
     if (sign!=DETAIL) {
-        GreyScaleImageView* paper=to_greyscale(*image_med);
-        delete image_med->data();
-        delete image_med;
+        GreyScaleImageView* paper=account_image(to_greyscale(*image_med));
+        release_image(image_med);
         return paper;
     }
     // final flood fill
     else {
-        GreyScaleImageView* paper0=to_greyscale(*image_med);
-        GreyScaleImageView* paper=flood_fill_holes_grey(*paper0);
-        delete image_med->data();
-        delete image_med;
-        delete paper0->data();
-        delete paper0;
+        GreyScaleImageView* paper0=account_image(to_greyscale(*image_med));
+        GreyScaleImageView* paper=flood_fill_holes_grey(*paper0, 4, pool);
+        release_image(image_med);
+        release_image(paper0);
         return paper;
     }
 
 }
 
 
+template<class T>
+GreyScaleImageView* paper_estimation(const T &src, int sign, int win_dil, int win_avg, int win_med)
+{
+    thread_pool pool(1);
+    return paper_estimation(src, sign, win_dil, win_avg, win_med, pool);
+}
+
+
 
 // ================= grey2logical =======================
 
@@ -448,7 +363,7 @@ struct to_logical_core : public std::unary_function<GreyScalePixel, T>
 template<class T>
 OneBitImageView* to_logical(const T &src)
 {
-    OneBitImageData* data = new OneBitImageData(src.size(), src.origin());
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
     OneBitImageView* view = new OneBitImageView(*data);
     transform(src.vec_begin(),
               src.vec_end(),
@@ -461,46 +376,107 @@ OneBitImageView* to_logical(const T &src)
 
 // ================= Edge Detection ======================
 
+// a run of edge pixels [begin, end) of a row, as a node of the union-find
+// of "edge_combine". The bounding box is valid at the root of a component.
+struct edge_run
+{
+    size_t row, begin, end;
+    size_t parent;
+    size_t left, top, right, bottom;
+};
+
+
+inline size_t edge_root(vector<edge_run> &runs, size_t i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+
+inline void edge_join(vector<edge_run> &runs, size_t i, size_t j)
+{
+    i = edge_root(runs, i);
+    j = edge_root(runs, j);
+    if (i == j)
+        return;
+    if (j < i)
+        std::swap(i, j);
+    runs[j].parent = i;
+    runs[i].left = std::min(runs[i].left, runs[j].left);
+    runs[i].top = std::min(runs[i].top, runs[j].top);
+    runs[i].right = std::max(runs[i].right, runs[j].right);
+    runs[i].bottom = std::max(runs[i].bottom, runs[j].bottom);
+}
+
+
 /* This function searchs the 2nd edge map for long edges and combines them into the 1st edge map.
  * the threshold for the minimum edge length in 2nd edge map is scale_length*maximum side of image.
+ * the edges of the 2nd map are labelled in one pass over its runs: each run
+   is joined to the runs of the previous row it touches (8-connectivity, as
+   "cc_analysis"), and the components keep their bounding box as they grow.
+   A second pass copies the runs of the long components.
  */
 template<class T>
 OneBitImageView* edge_combine(const T &src, const T &src2, double scale_length)
 {
-    typedef ConnectedComponent<OneBitImageData> CC;
     // define the threshold of minimum edge length
     double max_length=scale_length*((src.ncols()>src.nrows()) ? src.ncols() : src.nrows());
 
     OneBitImageView* edge_view = to_logical(src);
-    typename ImageFactory<OneBitImageView>::view_type* edge_view_cc = ImageFactory<OneBitImageView>::new_view(*edge_view);
-    OneBitImageView* edge2_view = to_logical(src2);
-    typename ImageFactory<OneBitImageView>::view_type* edge2_view_cc = ImageFactory<OneBitImageView>::new_view(*edge2_view);
-
-    ImageList* ccs2_list=cc_analysis(*edge2_view);
-    ImageList::iterator i;
-    unsigned int ccs_length;
-
-    for (i = ccs2_list->begin(); i != ccs2_list->end(); i++) {
-        ConnectedComponent<OneBitImageData>* cc_cur=static_cast<ConnectedComponent<OneBitImageData>* >(*i);
-        // compute the maximum length of bounding box of current edge
-        ccs_length=(cc_cur->ncols()>cc_cur->nrows()) ? cc_cur->ncols() : cc_cur->nrows();
-        // transfer the edge to final edge map
-        if (ccs_length > max_length) {
-            edge_view_cc->rect_set(cc_cur->origin(), cc_cur->size());
-            for (unsigned int m=0; m<cc_cur->nrows(); m++) {
-                for (unsigned int n=0; n<cc_cur->ncols(); n++) {
-                    if (cc_cur->get(Point(n,m))!=0) {
-                        edge_view_cc->set(Point(n,m), 1);
-                    }
-                }
+
+    // the runs of the 2nd edge map, labelled row by row
+    vector<edge_run> runs;
+    size_t previous = 0;    // the first run of the previous row
+    typename T::const_row_iterator row = src2.row_begin();
+    for (size_t y = 0; y < src2.nrows(); ++y, ++row) {
+        size_t current = runs.size();
+        size_t x = 0;
+        bool inside = false;
+        for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x) {
+            bool edge = (*col <= 1);
+            if (edge && !inside) {
+                edge_run run = { y, x, x + 1, runs.size(), x, y, x, y };
+                runs.push_back(run);
+            } else if (edge) {
+                runs.back().end = x + 1;
+                runs.back().right = x;
             }
+            inside = edge;
+        }
+        // runs touch when their columns overlap or meet at a corner
+        size_t k = previous;
+        for (size_t i = current; i < runs.size(); i++) {
+            while ((k < current) && (runs[k].end < runs[i].begin))
+                k++;
+            for (size_t j = k; (j < current) && (runs[j].begin <= runs[i].end); j++)
+                edge_join(runs, i, j);
+        }
+        previous = current;
+    }
+    account_bytes(runs.capacity() * sizeof(edge_run));
+
+    // transfer the long edges to final edge map
+    typename OneBitImageView::row_iterator out_row = edge_view->row_begin();
+    size_t i = 0;
+    for (size_t y = 0; y < edge_view->nrows(); ++y, ++out_row) {
+        typename OneBitImageView::row_iterator::iterator col = out_row.begin();
+        size_t x = 0;
+        for (; (i < runs.size()) && (runs[i].row == y); i++) {
+            const edge_run &root = runs[edge_root(runs, i)];
+            size_t ccs_length = std::max(root.right - root.left, root.bottom - root.top) + 1;
+            if (ccs_length <= max_length)
+                continue;
+            for (; x < runs[i].begin; ++x)
+                ++col;
+            for (; x < runs[i].end; ++x, ++col)
+                *col = 1;
         }
     }
 
-    delete edge_view_cc;
-    delete edge2_view->data();
-    delete edge2_view;
-    delete edge2_view_cc;
+    release_bytes(runs.capacity() * sizeof(edge_run));
     return edge_view;
 }
 
@@ -538,15 +514,13 @@ OneBitImageView* edge_detection(const T &src1, const T &src2,
                                 double scale_length)
 {
      // canny edge detection
-     GreyScaleImageView* edge1=canny_edge_image(src1, threshold1_scale, threshold1_gradient);
-     GreyScaleImageView* edge2=canny_edge_image(src2, threshold2_scale, threshold2_gradient);
+     GreyScaleImageView* edge1=account_image(canny_edge_image(src1, threshold1_scale, threshold1_gradient));
+     GreyScaleImageView* edge2=account_image(canny_edge_image(src2, threshold2_scale, threshold2_gradient));
 
      // edge combination
      OneBitImageView* edge_final=edge_combine(*edge1, *edge2, scale_length);
-     delete edge1->data();
-     delete edge1;
-     delete edge2->data();
-     delete edge2;
+     release_image(edge1);
+     release_image(edge2);
 
      return edge_final;
 }
@@ -599,65 +573,252 @@ bool region_isclear(const T &src)
 }
 
 
+// ------------- Packed Thinning ---------------------
+/* the structuring elements of the Haralick and Shapiro thinning of Gamera's
+   "thin_hs": two elements, each followed by its rotations by a quarter turn
+   clockwise, applied in turn. Neighbour i of a pixel is bit i of a mask,
+   clockwise from the north: N, NE, E, SE, S, SW, W, NW. A black pixel
+   matches when its "hit" neighbours are black and its "miss" neighbours
+   are white.
+ */
+static const unsigned char thin_hs_hit[2] = { 0x38, 0x50 };     // S, SE, SW / S, W
+static const unsigned char thin_hs_miss[2] = { 0x83, 0x07 };    // N, NE, NW / N, NE, E
+
+
+// the mask of neighbours turned by "quarters" quarter turns clockwise
+inline unsigned char thin_hs_rotate(unsigned char mask, int quarters)
+{
+    int shift = 2 * quarters;
+    return (unsigned char)(((mask << shift) | (mask >> (8 - shift))) & 0xff);
+}
+
+
+// the pixels at x-1 (west) and x+1 (east) of a packed row, moved to x
+inline packed_word west_word(const packed_word* row, size_t w)
+{
+    return (row[w] << 1) | ((w > 0) ? row[w - 1] >> 63 : 0);
+}
+
+
+inline packed_word east_word(const packed_word* row, size_t w, size_t words)
+{
+    return (row[w] >> 1) | ((w + 1 < words) ? row[w + 1] << 63 : 0);
+}
+
+
+/* this function applies one structuring element of the thinning to a packed
+   image: the black pixels that match are cleared, all decided on the image
+   before the element, 64 at a time. The pixels outside the image are white.
+   "above", "current" and "blank" are scratch rows of image.words() words,
+   "blank" all 0. It returns true if a pixel was cleared.
+ */
+inline bool thin_packed_element(packed_image &image, unsigned char hit, unsigned char miss,
+                                vector<packed_word> &above, vector<packed_word> &current,
+                                const vector<packed_word> &blank)
+{
+    size_t words = image.words();
+    bool cleared = false;
+    std::fill(above.begin(), above.end(), 0);
+    for (size_t y = 0; y < image.nrows(); ++y) {
+        packed_word* row = image.row(y);
+        const packed_word* below = (y + 1 < image.nrows()) ? image.row(y + 1) : &blank[0];
+        std::copy(row, row + words, current.begin());
+        for (size_t w = 0; w < words; ++w) {
+            if (current[w] == 0)
+                continue;
+            packed_word neighbours[8] = {
+                above[w], east_word(&above[0], w, words),
+                east_word(&current[0], w, words), east_word(below, w, words),
+                below[w], west_word(below, w),
+                west_word(&current[0], w), west_word(&above[0], w)
+            };
+            packed_word match = current[w];
+            for (int i = 0; i < 8; ++i) {
+                if (hit & (1 << i))
+                    match &= neighbours[i];
+                else if (miss & (1 << i))
+                    match &= ~neighbours[i];
+            }
+            if (match != 0) {
+                row[w] = current[w] & ~match;
+                cleared = true;
+            }
+        }
+        above.swap(current);
+    }
+    return cleared;
+}
+
+
+// one pass of the thinning: the eight elements in turn. It returns true if a pixel was cleared.
+inline bool thin_packed_pass(packed_image &image)
+{
+    vector<packed_word> above(image.words()), current(image.words()), blank(image.words(), 0);
+    bool updated = false;
+    for (int quarters = 0; quarters < 4; ++quarters) {
+        for (int e = 0; e < 2; ++e) {
+            if (thin_packed_element(image,
+                                    thin_hs_rotate(thin_hs_hit[e], quarters),
+                                    thin_hs_rotate(thin_hs_miss[e], quarters),
+                                    above, current, blank))
+                updated = true;
+        }
+    }
+    return updated;
+}
+
+
 /* this function computes the lyric_extraction of an image. However, it outputs the result after certain number of iterations, and the result may not be the ultimate lyric_extraction.
  * the code is adapted from Gamera c++ function "thin_hs" by Ichiro Fujinaga, Michael Droettboom and Karl MacMillan
+ * the image is thinned on packed rows (see "thin_packed_pass"), at most
+   "number_iteration" passes, or until it does not change if it is 0.
  */
 template<class T>
 typename ImageFactory<T>::view_type* lyric_extraction(const T& in, int number_iteration) {
-    int count=0;
     typedef typename ImageFactory<T>::data_type data_type;
     typedef typename ImageFactory<T>::view_type view_type;
-    Dim new_size(in.ncols() + 2, in.nrows() + 2);
-    bool upper_left_origin = (in.ul_x() == 0) || (in.ul_y() == 0);
-    Point new_origin;
-    if (upper_left_origin)
-      new_origin = Point(0, 0);
-    else
-      new_origin = Point(in.ul_x() - 1, in.ul_y() - 1);
-    data_type* thin_data = new data_type(new_size, new_origin);
-    view_type* thin_view = new view_type(*thin_data);
+    data_type* data = account_data(new data_type(in.size(), in.origin()));
+    view_type* view = new view_type(*data);
+    packed_image thin;
     try {
-      for (size_t y = 0; y != in.nrows(); ++y)
-    for (size_t x = 0; x != in.ncols(); ++x)
-      thin_view->set(Point(x + 1, y + 1), in.get(Point(x, y)));
-      if (in.nrows() == 1 || in.ncols() == 1)
-    goto end;
-      data_type* H_M_data = new data_type(new_size, new_origin);
-      view_type* H_M_view = new view_type(*H_M_data);
-      try {
-    bool not_finished = true;
-    while (not_finished) {
-      not_finished = thin_hs_one_pass(*thin_view, *H_M_view);
-      count++;
-      if (count==number_iteration)
-          break; }
-      } catch (std::exception e) {
-    delete H_M_view;
-    delete H_M_data;
-    throw;
-      }
-      delete H_M_view;
-      delete H_M_data;
+        pack_rows(in, thin);
+        account_bytes(thin.bytes());
+        if ((in.nrows() > 1) && (in.ncols() > 1)) {
+            int count = 0;
+            while (thin_packed_pass(thin)) {
+                count++;
+                if (count == number_iteration)
+                    break;
+            }
+        }
     } catch (std::exception e) {
-      delete thin_view;
-      delete thin_data;
-      throw;
+        release_bytes(thin.bytes());
+        release_image(view);
+        throw;
     }
-  end:
-    if (upper_left_origin) {
-      data_type* new_data = new data_type(in.size(), in.origin());
-      view_type* new_view = new view_type(*new_data);
-      for (size_t y = 0; y != in.nrows(); ++y)
-    for (size_t x = 0; x != in.ncols(); ++x)
-      new_view->set(Point(x, y), thin_view->get(Point(x + 1, y + 1)));
-      delete thin_view;
-      delete thin_data;
-      return new_view;
-    } else {
-      delete thin_view;
-      thin_view = new view_type(*thin_data, in);
-      return thin_view;
+    unpack_rows(thin, *view);
+    release_bytes(thin.bytes());
+    return view;
+}
+
+
+/* this function clears the two check boxes of "edge_reconnect" in "boundary"
+ */
+inline void check_boxes_clear(OneBitImageView &boundary, const Point &ul1, const Point &ul2, const Size &box)
+{
+    OneBitImageView check_box(*boundary.data());
+    check_box.rect_set(ul1, box);
+    region_clear(check_box);
+    check_box.rect_set(ul2, box);
+    region_clear(check_box);
+}
+
+
+/* this function checks if the edges of "boundary" enclose both check boxes:
+   the boxes must remain unflooded, that is, zero, after "flood_fill_bw".
+ */
+inline bool check_boxes_enclosed(const OneBitImageView &boundary, const Point &ul1, const Point &ul2, const Size &box)
+{
+    OneBitImageView* flood_test=flood_fill_bw(boundary);
+    flood_test->rect_set(ul1, box);
+    bool sign=region_isclear(*flood_test);
+    flood_test->rect_set(ul2, box);
+    sign=sign&&region_isclear(*flood_test);
+    release_image(flood_test);
+    return sign;
+}
+
+
+/* this function computes, for each pixel, the first iteration of
+   "edge_reconnect" at which it is an edge pixel, up to iteration "last"
+   (later pixels are left at INT_MAX).
+ * every iteration dilates the edge map by one pixel (3x3), then clears the
+   check boxes and the border with "border_clear". The cleared pixels do
+   not grow in the next iteration, and the pixels set by "border_clear" are
+   edges from iteration 1 on. An iteration is therefore the geodesic
+   chessboard distance from the initial edges through the pixels that are
+   not cleared, which is found by one breadth-first pass.
+ */
+template<class T>
+void reconnect_times(const T &src, const Point &ul1, const Point &ul2, const Size &box, int last, vector<int> &times)
+{
+    size_t ncols=src.ncols();
+    size_t nrows=src.nrows();
+    size_t n=ncols*nrows;
+
+    /* the pixels outside the check boxes, the pixels kept by every
+       iteration and the pixels set by every iteration, found by clearing an
+       image full of edges and an empty one with the same functions
+     */
+    vector<char> outside(n), kept(n), forced(n);
+    account_bytes(3*n);
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
+    OneBitImageView* view = new OneBitImageView(*data);
+    fill(view->vec_begin(), view->vec_end(), 1);
+    check_boxes_clear(*view, ul1, ul2, box);
+    copy(view->vec_begin(), view->vec_end(), outside.begin());
+    border_clear(*view);
+    copy(view->vec_begin(), view->vec_end(), kept.begin());
+    fill(view->vec_begin(), view->vec_end(), 0);
+    border_clear(*view);
+    copy(view->vec_begin(), view->vec_end(), forced.begin());
+    release_image(view);
+
+    // the initial edges are the edges outside the check boxes
+    times.assign(n, INT_MAX);
+    index_fifo fifo(n);
+    size_t i=0;
+    for (typename T::const_vec_iterator it=src.vec_begin(); it!=src.vec_end(); it++, i++) {
+        if (is_black(*it) && outside[i]) {
+            times[i]=0;
+            fifo.push(i);
+        }
+    }
+    if (last>=1) {
+        for (i=0; i<n; i++) {
+            if (forced[i] && (times[i]>1)) {
+                times[i]=1;
+                fifo.push(i);
+            }
+        }
+    }
+
+    // breadth-first growth; the cleared pixels only grow from iteration 0
+    while (!fifo.empty()) {
+        i=fifo.pop();
+        int t=times[i];
+        if ((t>=last) || ((t>0) && !kept[i]))
+            continue;
+        size_t x=i%ncols, y=i/ncols;
+        for (size_t v=(y>0 ? y-1 : 0); v<=std::min(y+1, nrows-1); v++) {
+            for (size_t u=(x>0 ? x-1 : 0); u<=std::min(x+1, ncols-1); u++) {
+                if (times[v*ncols+u]>t+1) {
+                    times[v*ncols+u]=t+1;
+                    fifo.push(v*ncols+u);
+                }
+            }
+        }
     }
+    release_bytes(3*n);
+}
+
+
+/* this function returns the edge map of "edge_reconnect" at iteration
+   "k", from the iterations computed by "reconnect_times".
+ */
+template<class T>
+OneBitImageView* reconnect_iteration(const T &src, const vector<int> &times, int k,
+                                     const Point &ul1, const Point &ul2, const Size &box)
+{
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
+    OneBitImageView* boundary = new OneBitImageView(*data);
+    size_t i=0;
+    for (OneBitImageView::vec_iterator it=boundary->vec_begin(); it!=boundary->vec_end(); it++, i++)
+        *it=(times[i]<=k) ? 1 : 0;
+    check_boxes_clear(*boundary, ul1, ul2, box);
+    if (k>0)
+        border_clear(*boundary);
+    return boundary;
 }
 
 
@@ -671,17 +832,19 @@ typename ImageFactory<T>::view_type* lyric_extraction(const T& in, int number_it
  * It assumes that the foreground region covers the central part of the
    image, and hence two small region in the center of the image are used as
    samples to check if a closed
+ * the edges grow by one pixel per iteration, for at most terminate_time+1
+   iterations. Instead of dilating and flood filling at every iteration, the
+   iteration at which each pixel becomes an edge is computed once (see
+   "reconnect_times"). Once the check boxes are enclosed they stay enclosed,
+   so the first closing iteration is found by bisection, with a flood fill
+   per step.
+ * when "cancel" is given and becomes true, NULL is returned at the next
+   step, as if the approach had failed.
  */
 template<class T>
-OneBitImageView* edge_reconnect(const T &src, int terminate_time)
+OneBitImageView* edge_reconnect(const T &src, int terminate_time, const std::atomic<bool>* cancel=NULL)
 {
     int count=0;  // count the number of iterations
-    bool sign;   // if there's an closed boundary, sign=1; otherwise, sign=0.
-    OneBitImageData* data = new OneBitImageData(src.size(), src.origin());
-    OneBitImageView* new_boundary = new OneBitImageView(*data);
-    copy(src.vec_begin(),
-              src.vec_end(),
-              new_boundary->vec_begin());
     OneBitImageView* boundary_temp;
 
     // define check-box
@@ -689,74 +852,76 @@ OneBitImageView* edge_reconnect(const T &src, int terminate_time)
     unsigned int block_height=src.nrows()/9;
     Point ul1(block_width*3, block_height*3);
     Point ul2(block_width*6, block_height*6);
+    Size box(block_width, block_height);
 
-    // first check
-    OneBitImageView* check_box=new OneBitImageView(*data);
-    check_box->rect_set(ul1, Size(block_width, block_height));
-    region_clear(*check_box);
-    check_box->rect_set(ul2, Size(block_width, block_height));
-    region_clear(*check_box);
-    OneBitImageView* flood_test=flood_fill_bw(*new_boundary);
-    flood_test->rect_set(ul1, Size(block_width, block_height));
-    sign=(region_isclear(*flood_test));
-    flood_test->rect_set(ul2, Size(block_width, block_height));
-    sign=sign&&(region_isclear(*flood_test));
-    delete flood_test->data();
-    delete flood_test;
-
-    while (!sign) {
-        // dilate edges
-        boundary_temp=erode_dilate(*new_boundary, 1, 0, 0);
-        delete new_boundary->data();
-        delete new_boundary;
-        delete check_box;
-        if (count>terminate_time) {
-            delete boundary_temp->data();
-            delete boundary_temp;
-            cout<<"unsuccess"<<'\n';
-            return NULL;
+    // the iteration at which each pixel becomes an edge
+    vector<int> times;
+    account_bytes(src.ncols()*src.nrows()*sizeof(int));
+    OneBitImageView* new_boundary=NULL;
+    try {
+        reconnect_times(src, ul1, ul2, box, std::max(terminate_time+1, 0), times);
+
+        // first check
+        new_boundary=reconnect_iteration(src, times, 0, ul1, ul2, box);
+        if (!check_boxes_enclosed(*new_boundary, ul1, ul2, box)) {
+            release_image(new_boundary);
+            new_boundary=NULL;
+            // the last iteration decides between success and failure
+            int failed=0;
+            count=terminate_time+1;
+            if (count>=1) {
+                new_boundary=reconnect_iteration(src, times, count, ul1, ul2, box);
+                if (!check_boxes_enclosed(*new_boundary, ul1, ul2, box)) {
+                    release_image(new_boundary);
+                    new_boundary=NULL;
+                }
+            }
+            if (new_boundary==NULL) {
+                release_bytes(src.ncols()*src.nrows()*sizeof(int));
+                return NULL;
+            }
+            // bisection between a failed and an enclosing iteration
+            while ((count-failed>1) && !((cancel!=NULL) && *cancel)) {
+                int middle=failed+(count-failed)/2;
+                boundary_temp=reconnect_iteration(src, times, middle, ul1, ul2, box);
+                if (check_boxes_enclosed(*boundary_temp, ul1, ul2, box)) {
+                    release_image(new_boundary);
+                    new_boundary=boundary_temp;
+                    count=middle;
+                }
+                else {
+                    release_image(boundary_temp);
+                    failed=middle;
+                }
+            }
         }
-        new_boundary=simple_image_copy(*boundary_temp);
-        delete boundary_temp->data();
-        delete boundary_temp;
-        // check by flood fill
-        check_box=new OneBitImageView(*(new_boundary->data()));
-        check_box->rect_set(ul1, Size(block_width, block_height));
-        region_clear(*check_box);
-        check_box->rect_set(ul2, Size(block_width, block_height));
-        region_clear(*check_box);
-        border_clear(*new_boundary);
-        flood_test=flood_fill_bw(*new_boundary);
-        flood_test->rect_set(ul1, Size(block_width, block_height));
-        sign=(region_isclear(*flood_test));
-        flood_test->rect_set(ul2, Size(block_width, block_height));
-        sign=sign&&(region_isclear(*flood_test));
-        delete flood_test->data();
-        delete flood_test;
-        count++;
-    }
-    boundary_temp=erode_dilate(*new_boundary, 1, 0, 0);
-    OneBitImageView* boundary_temp2=erode_dilate(*boundary_temp, 1, 1, 0);
-    delete new_boundary->data();
-    delete new_boundary;
-    delete check_box;
-    new_boundary=simple_image_copy(*boundary_temp2);
-    delete boundary_temp->data();
-    delete boundary_temp;
+    } catch (std::exception e) {
+        release_image(new_boundary);
+        release_bytes(src.ncols()*src.nrows()*sizeof(int));
+        throw;
+    }
+    release_bytes(src.ncols()*src.nrows()*sizeof(int));
+    if ((cancel!=NULL) && *cancel) {
+        release_image(new_boundary);
+        return NULL;
+    }
+
+    boundary_temp=account_image(erode_dilate_packed(*new_boundary, 1, 0));
+    OneBitImageView* boundary_temp2=account_image(erode_dilate_packed(*boundary_temp, 1, 1));
+    release_image(new_boundary);
+    release_image(boundary_temp);
 
     // lyric_extractionization
     OneBitImageView* skel_org=lyric_extraction(*boundary_temp2, count);
-    delete boundary_temp2->data();
-    delete boundary_temp2;
+    release_image(boundary_temp2);
     invert(*skel_org);
-    OneBitImageView* skel=erode_dilate(*skel_org, 1, 1, 0);
-    delete skel_org->data();
-    delete skel_org;
+    OneBitImageView* skel=account_image(erode_dilate_packed(*skel_org, 1, 1));
+    release_image(skel_org);
 
     // extract region of interest
     ImageList* ccs2_list;
     ccs2_list=cc_analysis(*skel);
-    data = new OneBitImageData(src.size(), src.origin());
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
     new_boundary = new OneBitImageView(*data);
     unsigned int label1=skel->get(ul1);
     unsigned int label2=skel->get(ul2);
@@ -767,29 +932,22 @@ OneBitImageView* edge_reconnect(const T &src, int terminate_time)
             }
         }
     }
-    delete skel->data();
-    delete skel;
-    boundary_temp=erode_dilate(*new_boundary, 3, 0, 0);
-    boundary_temp2=erode_dilate(*boundary_temp, 3, 1, 0);
-    delete new_boundary->data();
-    delete new_boundary;
-    new_boundary=simple_image_copy(*boundary_temp2);
-    delete boundary_temp->data();
-    delete boundary_temp;
-    delete boundary_temp2->data();
-    delete boundary_temp2;
-
-    GreyScaleImageView* boundary_grey=to_greyscale(*new_boundary);
+    release_image(skel);
+    boundary_temp=account_image(erode_dilate_packed(*new_boundary, 3, 0));
+    boundary_temp2=account_image(erode_dilate_packed(*boundary_temp, 3, 1));
+    release_image(new_boundary);
+    new_boundary=account_image(simple_image_copy(*boundary_temp2));
+    release_image(boundary_temp);
+    release_image(boundary_temp2);
+
+    GreyScaleImageView* boundary_grey=account_image(to_greyscale(*new_boundary));
     invert(*boundary_grey);
     GreyScaleImageView* mask_grey=flood_fill_holes_grey(*boundary_grey);
     OneBitImageView* mask=to_logical(*mask_grey);
     invert(*mask);
-    delete new_boundary->data();
-    delete new_boundary;
-    delete boundary_grey->data();
-    delete boundary_grey;
-    delete mask_grey->data();
-    delete mask_grey;
+    release_image(new_boundary);
+    release_image(boundary_grey);
+    release_image(mask_grey);
     return mask;
 
 }
@@ -804,7 +962,7 @@ OneBitImageView* edge_reconnect(const T &src, int terminate_time)
 template<class T>
 OneBitImageView* add_edge(const T &src, unsigned int interval)
 {
-    OneBitImageData* data = new OneBitImageData(src.size(), src.origin());
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
     OneBitImageView* view = new OneBitImageView(*data);
     copy(src.vec_begin(),
               src.vec_end(),
@@ -849,22 +1007,23 @@ OneBitImageView* boundary_reconstruct(const T &src,
 
     // 2nd round
     if (mask==NULL) {
+        cout<<"unsuccess"<<'\n';
         OneBitImageView* boundary=add_edge(src, interval2);
         mask=edge_reconnect(*boundary, terminate_time2);
-        delete boundary->data();
-        delete boundary;
+        release_image(boundary);
     }
 
     // 3rd round
     if (mask==NULL) {
+        cout<<"unsuccess"<<'\n';
         OneBitImageView* boundary=add_edge(src, interval3);
         mask=edge_reconnect(*boundary, terminate_time3);
-        delete boundary->data();
-        delete boundary;
+        release_image(boundary);
     }
     // when fail
     if (mask==NULL) {
-        OneBitImageData* data = new OneBitImageData(src.size(), src.origin());
+        cout<<"unsuccess"<<'\n';
+        OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
         mask = new OneBitImageView(*data);
     }
 
@@ -872,8 +1031,96 @@ OneBitImageView* boundary_reconstruct(const T &src,
 }
 
 
+/* the three rounds of "boundary_reconstruct" run at once on "pool". A round
+   that succeeds cancels the rounds after it, and the first round in order
+   that succeeds gives the mask, so the result is that of the serial rounds
+   while a page that needs the 3rd round takes about the time of one round.
+ * the rounds before the kept one report their failure after the run, in
+   order, so the output is that of the serial rounds.
+ */
+template<class T>
+OneBitImageView* boundary_reconstruct(const T &src,
+                                int terminate_time1, int terminate_time2, int terminate_time3,
+                                unsigned int interval2, unsigned int interval3,
+                                thread_pool &pool)
+{
+    int terminate_time[3]={terminate_time1, terminate_time2, terminate_time3};
+    unsigned int interval[3]={0, interval2, interval3};
+    OneBitImageView* masks[3]={NULL, NULL, NULL};
+    std::atomic<bool> cancel[3];
+    for (int round=0; round<3; round++)
+        cancel[round]=false;
+    memory_accounting* accounting=memory_accounting::active();
+
+    try {
+        pool.run(3, [&](size_t round) {
+            accounting_scope scope(accounting);
+            if (cancel[round])
+                return;
+            if (round==0)
+                masks[round]=edge_reconnect(src, terminate_time[round], &cancel[round]);
+            else {
+                OneBitImageView* boundary=add_edge(src, interval[round]);
+                try {
+                    masks[round]=edge_reconnect(*boundary, terminate_time[round], &cancel[round]);
+                } catch (std::exception e) {
+                    release_image(boundary);
+                    throw;
+                }
+                release_image(boundary);
+            }
+            if (masks[round]!=NULL) {
+                for (size_t later=round+1; later<3; later++)
+                    cancel[later]=true;
+            }
+        });
+    } catch (std::exception e) {
+        for (int round=0; round<3; round++)
+            release_image(masks[round]);
+        throw;
+    }
+
+    OneBitImageView* mask=NULL;
+    for (int round=0; round<3; round++) {
+        if (mask==NULL) {
+            mask=masks[round];
+            if (mask==NULL)
+                cout<<"unsuccess"<<'\n';
+        }
+        else
+            release_image(masks[round]);
+    }
+    // when fail
+    if (mask==NULL) {
+        OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
+        mask = new OneBitImageView(*data);
+    }
+    return mask;
+}
+
+
+template<class T>
+OneBitImageView* boundary_reconstruct(const T &src,
+                                int terminate_time1, int terminate_time2, int terminate_time3,
+                                unsigned int interval2, unsigned int interval3,
+                                int speculative)
+{
+    if (!speculative)
+        return boundary_reconstruct(src,
+                                terminate_time1, terminate_time2, terminate_time3,
+                                interval2, interval3);
+    thread_pool pool;
+    return boundary_reconstruct(src,
+                                terminate_time1, terminate_time2, terminate_time3,
+                                interval2, interval3, pool);
+}
+
+
 // ============================ Border Removal =============================
 // main function for border removal
+/* when "speculative" is not 0, the rounds of the boundary reconstruction
+   run at once (see "boundary_reconstruct"); the mask is the same.
+ */
 template<class T>
 OneBitImageView* border_removal(const T &src,
                                 int win_dil, int win_avg, int win_med,
@@ -881,52 +1128,125 @@ OneBitImageView* border_removal(const T &src,
                                 double threshold2_scale, double threshold2_gradient,
                                 double transfer_parameter,
                                 int terminate_time1, int terminate_time2, int terminate_time3,
-                                unsigned int interval2, unsigned int interval3)
+                                unsigned int interval2, unsigned int interval3,
+                                int speculative=0)
 {
-    // image resize
+    // image resize: pages larger than AREA_STANDARD are reduced by area averaging
+    accounting_stage stage("scale");
     double scalar=sqrt(double(AREA_STANDARD)/(src.nrows()*src.ncols()));
-    GreyScaleImageView* src_scale=static_cast<GreyScaleImageView*>(scale(src, scalar, 1));
-
-    // paper estimation
-    GreyScaleImageView* blur1=paper_estimation(*src_scale, SMOOTH, win_dil, win_avg, win_med);
-    GreyScaleImageView* blur2=paper_estimation(*src_scale, DETAIL, win_dil, win_avg, win_med);
-
-    // edge detection
-    OneBitImageView* boundary=edge_detection(*blur1, *blur2,
-                                threshold1_scale, threshold1_gradient,
-                                threshold2_scale, threshold2_gradient,
-                                transfer_parameter);
+    GreyScaleImageView* src_scale;
+    if (scalar<1.0)
+        src_scale=account_image(reduce_area(src, Dim(std::max((size_t)(src.ncols()*scalar), (size_t)1),
+                                                     std::max((size_t)(src.nrows()*scalar), (size_t)1))));
+    else
+        src_scale=account_image(static_cast<GreyScaleImageView*>(scale(src, scalar, 1)));
+
+    /* paper estimation and edge detection, as a graph of tasks: the two
+       paper estimations run at once, each Canny edge detector starts when
+       its paper estimation is done, and the edges are combined when both
+       are found. The tasks run their own steps serially.
+     */
+    stage.next("paper estimation and edge detection");
+    thread_pool pool;
+    memory_accounting* accounting=memory_accounting::active();
+    GreyScaleImageView* blur1=NULL;
+    GreyScaleImageView* blur2=NULL;
+    GreyScaleImageView* edge1=NULL;
+    GreyScaleImageView* edge2=NULL;
+    OneBitImageView* boundary=NULL;
+    task_graph graph;
+    size_t smooth=graph.add([&]() {
+        accounting_scope scope(accounting);
+        blur1=paper_estimation(*src_scale, SMOOTH, win_dil, win_avg, win_med, pool);
+    });
+    size_t detail=graph.add([&]() {
+        accounting_scope scope(accounting);
+        blur2=paper_estimation(*src_scale, DETAIL, win_dil, win_avg, win_med, pool);
+    });
+    size_t canny1=graph.add([&]() {
+        accounting_scope scope(accounting);
+        edge1=account_image(canny_edge_image(*blur1, threshold1_scale, threshold1_gradient));
+    }, {smooth});
+    size_t canny2=graph.add([&]() {
+        accounting_scope scope(accounting);
+        edge2=account_image(canny_edge_image(*blur2, threshold2_scale, threshold2_gradient));
+    }, {detail});
+    graph.add([&]() {
+        accounting_scope scope(accounting);
+        boundary=edge_combine(*edge1, *edge2, transfer_parameter);
+    }, {canny1, canny2});
+    try {
+        graph.run(pool);
+    } catch (std::exception e) {
+        release_image(src_scale);
+        release_image(blur1);
+        release_image(blur2);
+        release_image(edge1);
+        release_image(edge2);
+        release_image(boundary);
+        throw;
+    }
+    release_image(edge1);
+    release_image(edge2);
 
     // boundary reconstruct
-    OneBitImageView* mask_scale=boundary_reconstruct(*boundary,
+    stage.next("boundary reconstruction");
+    OneBitImageView* mask_scale;
+    if (speculative)
+        mask_scale=boundary_reconstruct(*boundary,
+                                terminate_time1, terminate_time2, terminate_time3,
+                                interval2, interval3, pool);
+    else
+        mask_scale=boundary_reconstruct(*boundary,
                                 terminate_time1, terminate_time2, terminate_time3,
                                 interval2, interval3);
 
-    // image resize back
-    OneBitImageView* mask_temp=static_cast<OneBitImageView*>(scale(*mask_scale, 1.0/scalar, 1));
-    OneBitImageData* data = new OneBitImageData(src.size(), src.origin());
+    // image resize back, straight into the mask
+    stage.next("scale back");
+    OneBitImageData* data = account_data(new OneBitImageData(src.size(), src.origin()));
     OneBitImageView* mask = new OneBitImageView(*data);
-    for (unsigned int m=0; m<mask->nrows(); m++) {
-        for (unsigned int n=0; n<mask->ncols(); n++) {
-            mask->set(Point(n, m), mask_temp->get(Point(n, m)));
-        }
-    }
+    expand_nearest(*mask_scale, *mask);
 
-    delete src_scale->data();
-    delete src_scale;
-    delete blur1->data();
-    delete blur1;
-    delete blur2->data();
-    delete blur2;
-    delete boundary->data();
-    delete boundary;
-    delete mask_scale->data();
-    delete mask_scale;
-    delete mask_temp->data();
-    delete mask_temp;
+    release_image(src_scale);
+    release_image(blur1);
+    release_image(blur2);
+    release_image(boundary);
+    release_image(mask_scale);
     return mask;
 
 }
 
+
+/* border removal with the memory accounting of the page by stage. It
+   returns the tuple (mask, accounting) where the accounting is a dict (see
+   "memory_accounting"), and appends the accounting to "json_file" as a line
+   of JSON unless it is empty.
+ */
+template<class T>
+PyObject* border_removal_with_accounting(const T &src,
+                                int win_dil, int win_avg, int win_med,
+                                double threshold1_scale, double threshold1_gradient,
+                                double threshold2_scale, double threshold2_gradient,
+                                double transfer_parameter,
+                                int terminate_time1, int terminate_time2, int terminate_time3,
+                                unsigned int interval2, unsigned int interval3,
+                                int speculative, const char* json_file)
+{
+    memory_accounting accounting("border_removal");
+    accounting.page(src.ncols(), src.nrows());
+    OneBitImageView* mask;
+    {
+        accounting_scope scope(accounting);
+        mask=border_removal(src,
+                            win_dil, win_avg, win_med,
+                            threshold1_scale, threshold1_gradient,
+                            threshold2_scale, threshold2_gradient,
+                            transfer_parameter,
+                            terminate_time1, terminate_time2, terminate_time3,
+                            interval2, interval3, speculative);
+    }
+    return accounted_result(mask, accounting, json_file);
+}
+
 //#endif
 
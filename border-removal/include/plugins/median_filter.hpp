@@ -0,0 +1,273 @@
+#ifndef MEDIAN_FILTER_HPP
+#define MEDIAN_FILTER_HPP
+
+#include "gamera.hpp"
+
+#include <vector>
+#include <algorithm>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ========== Sliding Histogram Median ===============
+
+/* this function returns the rank of the value picked by the median filters
+   in a region of n pixels. It is ceil(n/2)-1 evaluated in integers, as in
+   "image_med", i.e. the lower median for even n and one below the median
+   for odd n.
+ */
+inline size_t median_rank(size_t n)
+{
+    return (n / 2 > 0) ? n / 2 - 1 : 0;
+}
+
+
+/* the number of histogram bins used for a pixel type. GREY16 values above
+   65535 are clamped when the image is loaded.
+ */
+template<class T>
+struct median_traits {};
+
+template<>
+struct median_traits<GreyScalePixel>
+{
+    enum { bins = 256 };
+};
+
+template<>
+struct median_traits<Grey16Pixel>
+{
+    enum { bins = 65536 };
+};
+
+
+/* median filter of an 8-bit image after Perreault and Hebert, "Median
+   Filtering in Constant Time", IEEE Transactions on Image Processing, vol.16,
+   no.9, 2007, pp. 2389-2394.
+ * one histogram is kept per column, covering the rows of the current window.
+   Moving down one row costs one removal and one insertion per column;
+   moving right one column adds and subtracts one column histogram.
+ * histograms have 16 coarse bins of 16 fine bins each. The coarse kernel is
+   updated at every step, the fine kernel only for the coarse bin that holds
+   the median, and only when it is needed.
+ * the region is clipped at the image border like the other local filters.
+   One output row is written through "out_row" per image row.
+ */
+template<class RowIterator>
+void median_filter_rows(const GreyScalePixel* src, size_t ncols, size_t nrows,
+                        size_t half_region_size, RowIterator out_row)
+{
+    const size_t fine_bins = 256;
+    const size_t coarse_bins = 16;
+    const size_t shift = 4;
+
+    vector<unsigned short> column_fine(ncols * fine_bins, 0);
+    vector<unsigned short> column_coarse(ncols * coarse_bins, 0);
+    unsigned int kernel_fine[fine_bins];
+    unsigned int kernel_coarse[coarse_bins];
+    long fine_column[coarse_bins];  // column the fine bins were last updated for
+    size_t x, y, b;
+
+    // column histograms of the first window rows
+    for (y = 0; y <= std::min(half_region_size, nrows - 1); ++y) {
+        for (x = 0; x < ncols; ++x) {
+            GreyScalePixel value = src[y * ncols + x];
+            column_fine[x * fine_bins + value]++;
+            column_coarse[x * coarse_bins + (value >> shift)]++;
+        }
+    }
+
+    for (y = 0; y < nrows; ++y, ++out_row) {
+        // slide the column histograms down
+        if (y > 0) {
+            if (y > half_region_size) {
+                const GreyScalePixel* leaving = src + (y - half_region_size - 1) * ncols;
+                for (x = 0; x < ncols; ++x) {
+                    column_fine[x * fine_bins + leaving[x]]--;
+                    column_coarse[x * coarse_bins + (leaving[x] >> shift)]--;
+                }
+            }
+            if (y + half_region_size < nrows) {
+                const GreyScalePixel* entering = src + (y + half_region_size) * ncols;
+                for (x = 0; x < ncols; ++x) {
+                    column_fine[x * fine_bins + entering[x]]++;
+                    column_coarse[x * coarse_bins + (entering[x] >> shift)]++;
+                }
+            }
+        }
+        size_t y0 = (y > half_region_size) ? y - half_region_size : 0;
+        size_t y1 = std::min(y + half_region_size, nrows - 1);
+        size_t region_rows = y1 - y0 + 1;
+
+        // coarse kernel of the first window, fine kernel filled on demand
+        std::fill(kernel_coarse, kernel_coarse + coarse_bins, 0);
+        for (x = 0; x <= std::min(half_region_size, ncols - 1); ++x)
+            for (b = 0; b < coarse_bins; ++b)
+                kernel_coarse[b] += column_coarse[x * coarse_bins + b];
+        std::fill(fine_column, fine_column + coarse_bins, -1);
+
+        x = 0;
+        typename RowIterator::iterator out_col = out_row.begin();
+        for ( ; x < ncols; ++x, ++out_col) {
+            if (x > 0) {
+                if (x > half_region_size) {
+                    const unsigned short* leaving = &column_coarse[(x - half_region_size - 1) * coarse_bins];
+                    for (b = 0; b < coarse_bins; ++b)
+                        kernel_coarse[b] -= leaving[b];
+                }
+                if (x + half_region_size < ncols) {
+                    const unsigned short* entering = &column_coarse[(x + half_region_size) * coarse_bins];
+                    for (b = 0; b < coarse_bins; ++b)
+                        kernel_coarse[b] += entering[b];
+                }
+            }
+            size_t x0 = (x > half_region_size) ? x - half_region_size : 0;
+            size_t x1 = std::min(x + half_region_size, ncols - 1);
+            size_t rank = median_rank(region_rows * (x1 - x0 + 1));
+
+            // coarse bin holding the value of the requested rank
+            size_t below = 0;
+            for (b = 0; below + kernel_coarse[b] <= rank; ++b)
+                below += kernel_coarse[b];
+
+            // bring the fine bins of that coarse bin up to date
+            unsigned int* fine = kernel_fine + (b << shift);
+            if ((fine_column[b] < 0) || ((size_t)(x - fine_column[b]) > x1 - x0 + 1)) {
+                std::fill(fine, fine + coarse_bins, 0);
+                for (size_t c = x0; c <= x1; ++c) {
+                    const unsigned short* column = &column_fine[c * fine_bins + (b << shift)];
+                    for (size_t f = 0; f < coarse_bins; ++f)
+                        fine[f] += column[f];
+                }
+            }
+            else {
+                for (size_t c = fine_column[b] + 1; c <= x; ++c) {
+                    if (c > half_region_size) {
+                        const unsigned short* column = &column_fine[(c - half_region_size - 1) * fine_bins + (b << shift)];
+                        for (size_t f = 0; f < coarse_bins; ++f)
+                            fine[f] -= column[f];
+                    }
+                    if (c + half_region_size < ncols) {
+                        const unsigned short* column = &column_fine[(c + half_region_size) * fine_bins + (b << shift)];
+                        for (size_t f = 0; f < coarse_bins; ++f)
+                            fine[f] += column[f];
+                    }
+                }
+            }
+            fine_column[b] = x;
+
+            size_t f = 0;
+            for ( ; below + fine[f] <= rank; ++f)
+                below += fine[f];
+            *out_col = (GreyScalePixel)((b << shift) + f);
+        }
+    }
+}
+
+
+/* median filter of an image with up to "bins" levels after Huang, Yang and
+   Tang, "A Fast Two-Dimensional Median Filtering Algorithm", IEEE Transactions
+   on Acoustics, Speech and Signal Processing, vol.27, no.1, 1979, pp. 13-18.
+ * the window histogram slides along each row, and the median is tracked
+   incrementally from the previous pixel together with the number of values
+   below it. This keeps the cost independent of the number of levels, so it
+   is used for 16-bit images where per-column histograms would be too large.
+ */
+template<class Pixel, class RowIterator>
+void median_filter_rows(const Pixel* src, size_t ncols, size_t nrows,
+                        size_t half_region_size, RowIterator out_row, size_t bins)
+{
+    vector<unsigned int> histogram(bins, 0);
+    size_t x, y, m;
+
+    for (y = 0; y < nrows; ++y, ++out_row) {
+        size_t y0 = (y > half_region_size) ? y - half_region_size : 0;
+        size_t y1 = std::min(y + half_region_size, nrows - 1);
+        size_t region_rows = y1 - y0 + 1;
+
+        size_t median = 0;
+        size_t below = 0;   // number of values smaller than "median"
+        for (m = y0; m <= y1; ++m)
+            for (x = 0; x <= std::min(half_region_size, ncols - 1); ++x)
+                histogram[src[m * ncols + x]]++;
+
+        typename RowIterator::iterator out_col = out_row.begin();
+        for (x = 0; x < ncols; ++x, ++out_col) {
+            if (x > half_region_size) {
+                for (m = y0; m <= y1; ++m) {
+                    Pixel value = src[m * ncols + x - half_region_size - 1];
+                    histogram[value]--;
+                    if (value < median)
+                        below--;
+                }
+            }
+            if ((x > 0) && (x + half_region_size < ncols)) {
+                for (m = y0; m <= y1; ++m) {
+                    Pixel value = src[m * ncols + x + half_region_size];
+                    histogram[value]++;
+                    if (value < median)
+                        below++;
+                }
+            }
+            size_t x0 = (x > half_region_size) ? x - half_region_size : 0;
+            size_t x1 = std::min(x + half_region_size, ncols - 1);
+            size_t rank = median_rank(region_rows * (x1 - x0 + 1));
+
+            while (below > rank)
+                below -= histogram[--median];
+            while (below + histogram[median] <= rank)
+                below += histogram[median++];
+            *out_col = (Pixel)median;
+        }
+
+        // empty the histogram for the next row
+        size_t x0 = (ncols - 1 > half_region_size) ? ncols - 1 - half_region_size : 0;
+        for (m = y0; m <= y1; ++m)
+            for (x = x0; x < ncols; ++x)
+                histogram[src[m * ncols + x]]--;
+    }
+}
+
+
+template<class RowIterator>
+void median_filter_rows(const Grey16Pixel* src, size_t ncols, size_t nrows,
+                        size_t half_region_size, RowIterator out_row)
+{
+    median_filter_rows(src, ncols, nrows, half_region_size, out_row,
+                       (size_t)median_traits<Grey16Pixel>::bins);
+}
+
+
+template<class T>
+struct median_clamp
+{
+    T operator()(T x) { return std::min(x, (T)(median_traits<T>::bins - 1)); }
+};
+
+
+// main function of the histogram median filter
+/* it works on GREYSCALE and GREY16 images and returns an image of the same
+   pixel type. Results are identical to "med_filter" (same region clipping
+   and rank), without the per-pixel sort.
+ */
+template<class T>
+typename ImageFactory<T>::view_type* median_filter(const T &src, size_t region_size)
+{
+    if ((region_size < 1) || (region_size > std::min(src.nrows(), src.ncols())))
+        throw std::out_of_range("median_filter: region_size out of range");
+
+    typedef typename T::value_type value_type;
+    vector<value_type> pixels(src.nrows() * src.ncols());
+    transform(src.vec_begin(),
+              src.vec_end(),
+              pixels.begin(),
+              median_clamp<value_type>());
+
+    typename ImageFactory<T>::data_type* data = new typename ImageFactory<T>::data_type(src.size(), src.origin());
+    typename ImageFactory<T>::view_type* view = new typename ImageFactory<T>::view_type(*data);
+    median_filter_rows(&pixels[0], src.ncols(), src.nrows(), region_size / 2, view->row_begin());
+    return view;
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef MEMORY_ACCOUNTING_HPP
+#define MEMORY_ACCOUNTING_HPP
+
+#include "gameramodule.hpp"
+#include "gamera.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Memory Accounting =======================
+/* the memory a pipeline allocates for its images, by named stage: the
+   bytes allocated in the stage, the number of allocations, and the
+   high-water mark of the bytes held while the stage runs.
+ * the headers charge their image allocations through "account_data",
+   "account_image" and "release_image", which do nothing unless an
+   accounting is active on the calling thread (see "accounting_scope").
+   Images allocated by Gamera plugins are charged when they are returned.
+ * stages nest. An allocation is charged to the innermost stage, and the
+   high-water mark of all the open stages is raised.
+ */
+class memory_accounting
+{
+public:
+    struct stage
+    {
+        std::string name;
+        size_t bytes;
+        size_t allocations;
+        size_t peak;
+    };
+
+    explicit memory_accounting(const char* pipeline)
+        : m_pipeline(pipeline), m_ncols(0), m_nrows(0),
+          m_live(0), m_bytes(0), m_allocations(0), m_peak(0) {}
+
+    // the size of the page the accounting is for
+    void page(size_t ncols, size_t nrows)
+    {
+        m_ncols = ncols;
+        m_nrows = nrows;
+    }
+
+    /* bytes that are already held when the pipeline starts, such as the
+       buffers kept from the previous page. They count towards the
+       high-water marks but not as allocations.
+     */
+    void hold(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_live += bytes;
+        raise();
+    }
+
+    void allocate(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_live += bytes;
+        m_bytes += bytes;
+        m_allocations++;
+        if (!m_open.empty()) {
+            m_stages[m_open.back()].bytes += bytes;
+            m_stages[m_open.back()].allocations++;
+        }
+        raise();
+    }
+
+    // images allocated before the accounting started are released from 0
+    void release(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_live = (bytes < m_live) ? m_live - bytes : 0;
+    }
+
+    void enter(const char* name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t i = 0;
+        while ((i < m_stages.size()) && (m_stages[i].name != name))
+            i++;
+        if (i == m_stages.size()) {
+            stage s = { name, 0, 0, 0 };
+            m_stages.push_back(s);
+        }
+        m_open.push_back(i);
+        raise();
+    }
+
+    void leave()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_open.pop_back();
+    }
+
+    const std::vector<stage> &stages() const { return m_stages; }
+    size_t bytes() const { return m_bytes; }
+    size_t allocations() const { return m_allocations; }
+    size_t peak() const { return m_peak; }
+
+    /* the accounting as a Python dict:
+       {"pipeline", "ncols", "nrows", "bytes", "allocations", "peak",
+        "stages": [{"name", "bytes", "allocations", "peak"}, ...]}
+       with the stages in the order they were first entered.
+     */
+    PyObject* dict() const
+    {
+        PyObject* stages = PyList_New(0);
+        for (size_t i = 0; i < m_stages.size(); i++) {
+            PyObject* s = PyDict_New();
+            set_item(s, "name", Py_BuildValue("s", m_stages[i].name.c_str()));
+            set_item(s, "bytes", PyLong_FromSize_t(m_stages[i].bytes));
+            set_item(s, "allocations", PyLong_FromSize_t(m_stages[i].allocations));
+            set_item(s, "peak", PyLong_FromSize_t(m_stages[i].peak));
+            PyList_Append(stages, s);
+            Py_DECREF(s);
+        }
+        PyObject* result = PyDict_New();
+        set_item(result, "pipeline", Py_BuildValue("s", m_pipeline.c_str()));
+        set_item(result, "ncols", PyLong_FromSize_t(m_ncols));
+        set_item(result, "nrows", PyLong_FromSize_t(m_nrows));
+        set_item(result, "bytes", PyLong_FromSize_t(m_bytes));
+        set_item(result, "allocations", PyLong_FromSize_t(m_allocations));
+        set_item(result, "peak", PyLong_FromSize_t(m_peak));
+        set_item(result, "stages", stages);
+        return result;
+    }
+
+    // the same content as "dict", as one line of JSON
+    std::string json() const
+    {
+        std::string line = "{\"pipeline\": " + quote(m_pipeline)
+            + ", \"ncols\": " + number(m_ncols)
+            + ", \"nrows\": " + number(m_nrows)
+            + ", \"bytes\": " + number(m_bytes)
+            + ", \"allocations\": " + number(m_allocations)
+            + ", \"peak\": " + number(m_peak)
+            + ", \"stages\": [";
+        for (size_t i = 0; i < m_stages.size(); i++) {
+            if (i > 0)
+                line += ", ";
+            line += "{\"name\": " + quote(m_stages[i].name)
+                + ", \"bytes\": " + number(m_stages[i].bytes)
+                + ", \"allocations\": " + number(m_stages[i].allocations)
+                + ", \"peak\": " + number(m_stages[i].peak) + "}";
+        }
+        return line + "]}";
+    }
+
+    // appends the JSON line to "filename"
+    void write_json_line(const char* filename) const
+    {
+        FILE* file = fopen(filename, "a");
+        if (file == NULL)
+            throw std::runtime_error(std::string("memory_accounting: cannot open ") + filename);
+        std::string line = json() + "\n";
+        size_t written = fwrite(line.data(), 1, line.size(), file);
+        if ((fclose(file) != 0) || (written != line.size()))
+            throw std::runtime_error(std::string("memory_accounting: cannot write ") + filename);
+    }
+
+    // the accounting active on the calling thread, or NULL
+    static memory_accounting* &active()
+    {
+        static thread_local memory_accounting* accounting = NULL;
+        return accounting;
+    }
+
+private:
+    memory_accounting(const memory_accounting &);
+    memory_accounting &operator=(const memory_accounting &);
+
+    void raise()
+    {
+        m_peak = std::max(m_peak, m_live);
+        for (size_t i = 0; i < m_open.size(); i++)
+            m_stages[m_open[i]].peak = std::max(m_stages[m_open[i]].peak, m_live);
+    }
+
+    static void set_item(PyObject* dict, const char* key, PyObject* value)
+    {
+        PyDict_SetItemString(dict, key, value);
+        Py_DECREF(value);
+    }
+
+    static std::string number(size_t value)
+    {
+        char buffer[32];
+        sprintf(buffer, "%lu", (unsigned long)value);
+        return buffer;
+    }
+
+    static std::string quote(const std::string &text)
+    {
+        std::string quoted = "\"";
+        for (size_t i = 0; i < text.size(); i++) {
+            if ((text[i] == '"') || (text[i] == '\\'))
+                quoted += '\\';
+            quoted += text[i];
+        }
+        return quoted + "\"";
+    }
+
+    std::string m_pipeline;
+    size_t m_ncols, m_nrows;
+    std::vector<stage> m_stages;
+    std::vector<size_t> m_open;     // indices of the open stages, innermost last
+    size_t m_live;
+    size_t m_bytes;
+    size_t m_allocations;
+    size_t m_peak;
+    std::mutex m_mutex;
+};
+
+
+// makes "accounting" the active accounting of the calling thread while it lives
+class accounting_scope
+{
+public:
+    explicit accounting_scope(memory_accounting &accounting)
+        : m_previous(memory_accounting::active())
+    {
+        memory_accounting::active() = &accounting;
+    }
+
+    /* makes "accounting" active, or none if it is NULL. Tasks on a thread
+       pool take the accounting of the thread that started them this way.
+     */
+    explicit accounting_scope(memory_accounting* accounting)
+        : m_previous(memory_accounting::active())
+    {
+        memory_accounting::active() = accounting;
+    }
+
+    ~accounting_scope() { memory_accounting::active() = m_previous; }
+
+private:
+    accounting_scope(const accounting_scope &);
+    accounting_scope &operator=(const accounting_scope &);
+
+    memory_accounting* m_previous;
+};
+
+
+// a named stage of the active accounting, open while it lives
+class accounting_stage
+{
+public:
+    explicit accounting_stage(const char* name)
+        : m_accounting(memory_accounting::active())
+    {
+        if (m_accounting != NULL)
+            m_accounting->enter(name);
+    }
+
+    ~accounting_stage()
+    {
+        if (m_accounting != NULL)
+            m_accounting->leave();
+    }
+
+    // closes the stage and opens the stage "name" in its place
+    void next(const char* name)
+    {
+        if (m_accounting != NULL) {
+            m_accounting->leave();
+            m_accounting->enter(name);
+        }
+    }
+
+    // closes the stage before the end of the scope
+    void close()
+    {
+        if (m_accounting != NULL)
+            m_accounting->leave();
+        m_accounting = NULL;
+    }
+
+private:
+    accounting_stage(const accounting_stage &);
+    accounting_stage &operator=(const accounting_stage &);
+
+    memory_accounting* m_accounting;
+};
+
+
+// ------------- Charging Allocations ---------------------
+// the bytes of the pixels of an image data
+template<class D>
+size_t image_bytes(const D &data)
+{
+    return data.ncols() * data.nrows() * sizeof(typename D::value_type);
+}
+
+
+// charges "bytes" allocated outside of an image (e.g. a page-size table)
+inline void account_bytes(size_t bytes)
+{
+    if (memory_accounting::active() != NULL)
+        memory_accounting::active()->allocate(bytes);
+}
+
+
+inline void release_bytes(size_t bytes)
+{
+    if (memory_accounting::active() != NULL)
+        memory_accounting::active()->release(bytes);
+}
+
+
+// charges a newly allocated image data, and returns it
+template<class D>
+D* account_data(D* data)
+{
+    if (data != NULL)
+        account_bytes(image_bytes(*data));
+    return data;
+}
+
+
+// charges the data of a newly allocated image, and returns the image
+template<class V>
+V* account_image(V* view)
+{
+    if (view != NULL)
+        account_data(view->data());
+    return view;
+}
+
+
+// deletes an image data charged by "account_data"
+template<class D>
+void release_data(D* data)
+{
+    if (data != NULL)
+        release_bytes(image_bytes(*data));
+    delete data;
+}
+
+
+// deletes an image and its data charged by "account_image"
+template<class V>
+void release_image(V* view)
+{
+    if (view == NULL)
+        return;
+    typename V::data_type* data = view->data();
+    delete view;
+    release_data(data);
+}
+
+
+/* the result of a pipeline run with "accounting", for Python: the tuple
+   (image, dict of the accounting). If "json_file" is not empty, the
+   accounting is also appended to it as one line of JSON.
+ */
+inline PyObject* accounted_result(Image* image, const memory_accounting &accounting, const char* json_file)
+{
+    PyObject* result = Py_BuildValue("(NN)", create_ImageObject(image), accounting.dict());
+    if ((json_file != NULL) && (json_file[0] != '\0')) {
+        try {
+            accounting.write_json_line(json_file);
+        } catch (std::exception e) {
+            Py_DECREF(result);
+            throw;
+        }
+    }
+    return result;
+}
+
+#endif
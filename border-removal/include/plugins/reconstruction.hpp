@@ -0,0 +1,474 @@
+#ifndef RECONSTRUCTION_HPP
+#define RECONSTRUCTION_HPP
+
+#include "gamera.hpp"
+#include "memory_accounting.hpp"
+#include "parallel.hpp"
+#include "packed_rows.hpp"
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Morphological Reconstruction =======================
+/* the neighbours of a pixel in a table of "stride" columns, as offsets of
+   linear indices. "before" holds the neighbours visited before the pixel in
+   raster order, "after" the ones visited after it.
+ */
+template<int conn>
+struct reconstruction_neighbours {};
+
+template<>
+struct reconstruction_neighbours<4>
+{
+    enum { half = 2 };
+
+    static void offsets(ptrdiff_t stride, ptrdiff_t* before, ptrdiff_t* after)
+    {
+        before[0] = -stride;
+        before[1] = -1;
+        after[0] = 1;
+        after[1] = stride;
+    }
+};
+
+template<>
+struct reconstruction_neighbours<8>
+{
+    enum { half = 4 };
+
+    static void offsets(ptrdiff_t stride, ptrdiff_t* before, ptrdiff_t* after)
+    {
+        before[0] = -stride - 1;
+        before[1] = -stride;
+        before[2] = -stride + 1;
+        before[3] = -1;
+        after[0] = 1;
+        after[1] = stride - 1;
+        after[2] = stride;
+        after[3] = stride + 1;
+    }
+};
+
+
+/* first-in first-out queue of linear pixel indices in a ring buffer. The
+   capacity is a power of two and doubles when the queue is full.
+ */
+class index_fifo
+{
+public:
+    explicit index_fifo(size_t capacity = 0)
+        : m_head(0), m_size(0)
+    {
+        size_t n = 16;
+        while (n < capacity)
+            n *= 2;
+        m_buffer.resize(n);
+    }
+
+    bool empty() const { return m_size == 0; }
+
+    void push(ptrdiff_t index)
+    {
+        if (m_size == m_buffer.size())
+            grow();
+        m_buffer[(m_head + m_size) & (m_buffer.size() - 1)] = index;
+        m_size++;
+    }
+
+    ptrdiff_t pop()
+    {
+        ptrdiff_t index = m_buffer[m_head];
+        m_head = (m_head + 1) & (m_buffer.size() - 1);
+        m_size--;
+        return index;
+    }
+
+private:
+    void grow()
+    {
+        vector<ptrdiff_t> buffer(m_buffer.size() * 2);
+        for (size_t i = 0; i < m_size; i++)
+            buffer[i] = m_buffer[(m_head + i) & (m_buffer.size() - 1)];
+        m_buffer.swap(buffer);
+        m_head = 0;
+    }
+
+    vector<ptrdiff_t> m_buffer;
+    size_t m_head;
+    size_t m_size;
+};
+
+
+/* the propagation step of the reconstruction: the pixels in "fifo" raise
+   their neighbours, which are queued in turn, until no pixel can be raised.
+   The indices are relative to "mask" and "marker" and may be negative.
+ */
+template<int conn, class V>
+void propagate_guarded(const V* mask, V* marker, size_t ncols, index_fifo &fifo)
+{
+    typedef reconstruction_neighbours<conn> neighbours;
+
+    ptrdiff_t before[neighbours::half], after[neighbours::half];
+    neighbours::offsets(ncols + 2, before, after);
+
+    while (!fifo.empty()) {
+        ptrdiff_t p = fifo.pop();
+        V value = marker[p];
+        for (int n = 0; n < neighbours::half; n++) {
+            ptrdiff_t q = p + before[n];
+            if ((marker[q] < value) && (marker[q] != mask[q])) {
+                marker[q] = std::min(value, mask[q]);
+                fifo.push(q);
+            }
+        }
+        for (int n = 0; n < neighbours::half; n++) {
+            ptrdiff_t q = p + after[n];
+            if ((marker[q] < value) && (marker[q] != mask[q])) {
+                marker[q] = std::min(value, mask[q]);
+                fifo.push(q);
+            }
+        }
+    }
+}
+
+
+/* greyscale reconstruction of "mask" from "marker", after Luc Vincent,
+   "Morphological Grayscale Reconstruction In Image Analysis: Applications
+   and Efficient Algorithms", IEEE Transactions on Image Processing, vol.2,
+   no.2, April 1993, pp. 176-201 (the hybrid algorithm).
+ * both tables hold ncols x nrows pixels inside a guard border of one pixel,
+   in rows of ncols+2 values. A guard pixel must hold the same value in
+   both tables: it is never raised and never queued by the scans, so they
+   need no border checks. The lowest value of V leaves the pixels next to
+   it unchanged.
+ * a raster and an anti-raster scan propagate the marker, then the pixels
+   that can still raise a neighbour are propagated through the queue.
+ */
+template<int conn, class V>
+void reconstruct_guarded(const V* mask, V* marker, size_t ncols, size_t nrows, index_fifo &fifo)
+{
+    typedef reconstruction_neighbours<conn> neighbours;
+
+    const ptrdiff_t stride = ncols + 2;
+    ptrdiff_t before[neighbours::half], after[neighbours::half];
+    neighbours::offsets(stride, before, after);
+
+    // raster scanning
+    for (size_t y = 1; y <= nrows; ++y) {
+        V* m = marker + y * stride + 1;
+        const V* k = mask + y * stride + 1;
+        for (size_t x = 0; x < ncols; ++x, ++m, ++k) {
+            V value = *m;
+            for (int n = 0; n < neighbours::half; n++)
+                value = std::max(value, m[before[n]]);
+            *m = std::min(value, *k);
+        }
+    }
+
+    // anti-raster scanning
+    for (size_t y = nrows; y >= 1; --y) {
+        ptrdiff_t p = y * stride + ncols;
+        for (size_t x = 0; x < ncols; ++x, --p) {
+            V value = marker[p];
+            for (int n = 0; n < neighbours::half; n++)
+                value = std::max(value, marker[p + after[n]]);
+            value = std::min(value, mask[p]);
+            marker[p] = value;
+            for (int n = 0; n < neighbours::half; n++) {
+                ptrdiff_t q = p + after[n];
+                if ((marker[q] < value) && (marker[q] < mask[q])) {
+                    fifo.push(p);
+                    break;
+                }
+            }
+        }
+    }
+
+    // propagation
+    propagate_guarded<conn>(mask, marker, ncols, fifo);
+}
+
+
+template<int conn, class V>
+void reconstruct_guarded(const V* mask, V* marker, size_t ncols, size_t nrows)
+{
+    index_fifo fifo(2 * (ncols + nrows));
+    reconstruct_guarded<conn>(mask, marker, ncols, nrows, fifo);
+}
+
+
+/* copies the rows [begin, end) of an image into a table of rows of ncols+2
+   values, below "margin" rows and above "margin" rows of guard pixels.
+ */
+template<class T>
+void guarded_copy(const T &src, size_t begin, size_t end, size_t margin, vector<typename T::value_type> &table)
+{
+    size_t stride = src.ncols() + 2;
+    table.assign(stride * (end - begin + 2 * margin), std::numeric_limits<typename T::value_type>::lowest());
+    typename T::const_row_iterator row = advance_rows(src.row_begin(), begin);
+    for (size_t y = margin; y < end - begin + margin; ++y, ++row)
+        std::copy(row.begin(), row.end(), table.begin() + (y * stride + 1));
+}
+
+
+// copies the rows of a table written by "guarded_copy" back into the image
+template<class T>
+void guarded_copy_back(const vector<typename T::value_type> &table, size_t begin, size_t end, size_t margin, T &dest)
+{
+    size_t stride = dest.ncols() + 2;
+    typename T::row_iterator row = advance_rows(dest.row_begin(), begin);
+    for (size_t y = margin; y < end - begin + margin; ++y, ++row) {
+        typename vector<typename T::value_type>::const_iterator first = table.begin() + (y * stride + 1);
+        std::copy(first, first + dest.ncols(), row.begin());
+    }
+}
+
+
+/* greyscale reconstruction of the image "mask" from the image "marker",
+   in place in "marker". "conn" is the connectivity, 4 or 8.
+ */
+template<class T>
+void reconstruct(const T &mask, T &marker, int conn)
+{
+    typedef typename T::value_type value_type;
+
+    if ((conn != 4) && (conn != 8))
+        throw std::invalid_argument("reconstruct: connectivity must be 4 or 8");
+    if (mask.size() != marker.size())
+        throw std::invalid_argument("reconstruct: sizes must match");
+
+    size_t ncols = marker.ncols();
+    size_t nrows = marker.nrows();
+    size_t table_bytes = 2 * (ncols + 2) * (nrows + 2) * sizeof(value_type);
+    vector<value_type> mask_table, marker_table;
+    account_bytes(table_bytes);
+    try {
+        guarded_copy(mask, 0, nrows, 1, mask_table);
+        guarded_copy(marker, 0, nrows, 1, marker_table);
+        if (conn == 4)
+            reconstruct_guarded<4>(&mask_table[0], &marker_table[0], ncols, nrows);
+        else
+            reconstruct_guarded<8>(&mask_table[0], &marker_table[0], ncols, nrows);
+    } catch (std::exception e) {
+        release_bytes(table_bytes);
+        throw;
+    }
+
+    guarded_copy_back(marker_table, 0, nrows, 1, marker);
+    release_bytes(table_bytes);
+}
+
+
+// ------------- Parallel Reconstruction ---------------------
+/* a band of rows of the image reconstructed by one task. Its tables have
+   two rows of guard pixels above and below the band. The inner guard rows
+   hold the edge rows of the neighbouring bands, with the same value in
+   both tables, so the neighbours raise the band but are not raised by it.
+ */
+template<class V>
+struct reconstruction_band
+{
+    size_t begin, end;
+    vector<V> mask, marker;
+    index_fifo fifo;
+};
+
+
+/* this function copies an edge row of a neighbouring band into a guard row
+   of a band, and queues the guard pixels that were raised, so they are
+   propagated into the band. It returns true if any pixel was raised.
+ */
+template<class V>
+bool exchange_edge(const V* edge, V* mask, V* marker, ptrdiff_t index, size_t ncols, index_fifo &fifo)
+{
+    bool raised = false;
+    for (size_t x = 0; x < ncols; ++x) {
+        if (edge[x] != marker[x]) {
+            mask[x] = edge[x];
+            marker[x] = edge[x];
+            fifo.push(index + x);
+            raised = true;
+        }
+    }
+    return raised;
+}
+
+
+/* greyscale reconstruction by bands of rows on "pool". Each band is first
+   reconstructed on its own, then the edge rows are exchanged between
+   neighbouring bands and the raised pixels propagated, until no edge row
+   changes. The reconstruction is unique, so the result is identical to the
+   serial one.
+ */
+template<int conn, class T>
+void reconstruct_bands(const T &mask, T &marker, size_t blocks, thread_pool &pool)
+{
+    typedef typename T::value_type value_type;
+    typedef reconstruction_band<value_type> band_type;
+
+    size_t ncols = marker.ncols();
+    size_t nrows = marker.nrows();
+    size_t stride = ncols + 2;
+    size_t table_bytes = 2 * stride * (nrows + 4 * blocks) * sizeof(value_type);
+    vector<band_type> bands(blocks);
+    vector<char> raised(blocks);
+
+    account_bytes(table_bytes);
+    try {
+        pool.run(blocks, [&](size_t i) {
+            band_type &band = bands[i];
+            block_range(nrows, blocks, i, band.begin, band.end);
+            guarded_copy(mask, band.begin, band.end, 2, band.mask);
+            guarded_copy(marker, band.begin, band.end, 2, band.marker);
+            reconstruct_guarded<conn>(&band.mask[stride], &band.marker[stride], ncols,
+                                      band.end - band.begin, band.fifo);
+        });
+
+        for (;;) {
+            // the guard rows are written by their own band only
+            pool.run(blocks, [&](size_t i) {
+                band_type &band = bands[i];
+                size_t rows = band.end - band.begin;
+                raised[i] = false;
+                if (i > 0) {
+                    const band_type &above = bands[i - 1];
+                    size_t last = (above.end - above.begin + 1) * stride + 1;
+                    raised[i] |= exchange_edge(&above.marker[last], &band.mask[stride + 1],
+                                               &band.marker[stride + 1], 1, ncols, band.fifo);
+                }
+                if (i + 1 < blocks) {
+                    const band_type &below = bands[i + 1];
+                    size_t guard = (rows + 2) * stride + 1;
+                    raised[i] |= exchange_edge(&below.marker[2 * stride + 1], &band.mask[guard],
+                                               &band.marker[guard], (rows + 1) * stride + 1, ncols, band.fifo);
+                }
+            });
+            if (std::find(raised.begin(), raised.end(), true) == raised.end())
+                break;
+            pool.run(blocks, [&](size_t i) {
+                if (raised[i])
+                    propagate_guarded<conn>(&bands[i].mask[stride], &bands[i].marker[stride], ncols, bands[i].fifo);
+            });
+        }
+
+        pool.run(blocks, [&](size_t i) {
+            guarded_copy_back(bands[i].marker, bands[i].begin, bands[i].end, 2, marker);
+        });
+    } catch (std::exception e) {
+        release_bytes(table_bytes);
+        throw;
+    }
+    release_bytes(table_bytes);
+}
+
+
+/* greyscale reconstruction on "pool". Images with fewer rows than two bands
+   of "min_band_rows" are reconstructed serially.
+ */
+template<class T>
+void reconstruct(const T &mask, T &marker, int conn, thread_pool &pool)
+{
+    const size_t min_band_rows = 64;
+
+    size_t blocks = std::min(pool.size(), marker.nrows() / min_band_rows);
+    if ((blocks < 2) || (mask.size() != marker.size()) || ((conn != 4) && (conn != 8))) {
+        reconstruct(mask, marker, conn);
+        return;
+    }
+    if (conn == 4)
+        reconstruct_bands<4>(mask, marker, blocks, pool);
+    else
+        reconstruct_bands<8>(mask, marker, blocks, pool);
+}
+
+
+// ------------- Binary Reconstruction ---------------------
+/* binary reconstruction of the packed image "mask" from "marker", in place
+   in "marker": the result holds the connected regions of "mask" that
+   contain a pixel of "marker". "marker" must be within "mask".
+ * a row is filled by its horizontal spans of "mask" bits that touch the
+   marker in the row or in the rows above and below (with the neighbours
+   one column aside for 8-connectivity). The rows whose marker changes
+   queue their neighbouring rows, until no row changes.
+ */
+template<int conn>
+void reconstruct_packed(const packed_image &mask, packed_image &marker)
+{
+    size_t nrows = mask.nrows();
+    size_t words = mask.words();
+    vector<packed_word> seeds(words);
+    vector<char> queued(nrows, 1);
+    index_fifo rows(nrows);
+    for (size_t y = 0; y < nrows; ++y)
+        rows.push(y);
+
+    while (!rows.empty()) {
+        size_t y = rows.pop();
+        queued[y] = 0;
+        packed_word* current = marker.row(y);
+        std::copy(current, current + words, seeds.begin());
+        for (int side = -1; side <= 1; side += 2) {
+            if (((side < 0) && (y == 0)) || ((side > 0) && (y + 1 == nrows)))
+                continue;
+            const packed_word* neighbour = marker.row(y + side);
+            for (size_t w = 0; w < words; ++w)
+                seeds[w] |= neighbour[w];
+            if (conn == 8) {
+                or_shifted_right(neighbour, &seeds[0], words);
+                or_shifted_left(neighbour, &seeds[0], words);
+            }
+        }
+        const packed_word* region = mask.row(y);
+        for (size_t w = 0; w < words; ++w)
+            seeds[w] &= region[w];
+        fill_row_runs(&seeds[0], region, words);
+
+        if (!std::equal(seeds.begin(), seeds.end(), current)) {
+            std::copy(seeds.begin(), seeds.end(), current);
+            if ((y > 0) && !queued[y - 1]) {
+                queued[y - 1] = 1;
+                rows.push(y - 1);
+            }
+            if ((y + 1 < nrows) && !queued[y + 1]) {
+                queued[y + 1] = 1;
+                rows.push(y + 1);
+            }
+        }
+    }
+}
+
+
+/* this function marks the pixels of "region" that are connected to the
+   border of the image, in "reached".
+ */
+inline void reconstruct_from_border(const packed_image &region, packed_image &reached, int conn)
+{
+    if ((conn != 4) && (conn != 8))
+        throw std::invalid_argument("reconstruct: connectivity must be 4 or 8");
+
+    size_t ncols = region.ncols();
+    size_t nrows = region.nrows();
+    reached.resize(ncols, nrows);
+    if ((ncols == 0) || (nrows == 0))
+        return;
+    for (size_t y = 0; y < nrows; ++y) {
+        if ((y == 0) || (y + 1 == nrows))
+            std::copy(region.row(y), region.row(y) + region.words(), reached.row(y));
+        else {
+            reached.set(0, y, region.get(0, y));
+            reached.set(ncols - 1, y, region.get(ncols - 1, y));
+        }
+    }
+    if (conn == 4)
+        reconstruct_packed<4>(region, reached);
+    else
+        reconstruct_packed<8>(region, reached);
+}
+
+#endif
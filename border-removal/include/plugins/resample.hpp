@@ -0,0 +1,256 @@
+#ifndef RESAMPLE_HPP
+#define RESAMPLE_HPP
+
+#include "gamera.hpp"
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Resampling =======================
+/* this function converts an interpolated value to a pixel value, rounding
+   to the nearest level for integer pixel types.
+ */
+template<class T>
+T resample_pixel(double value)
+{
+    if (std::numeric_limits<T>::is_integer)
+        return (T)(value + 0.5);
+    return (T)value;
+}
+
+
+/* this function reduces an image by an integer factor. Each pixel of the
+   result is the mean of a factor*factor block of the image; the blocks at
+   the right and bottom border are clipped, so the result has
+   ceil(ncols/factor) x ceil(nrows/factor) pixels.
+ */
+template<class T>
+typename ImageFactory<T>::view_type* reduce_mean(const T &src, size_t factor)
+{
+    typedef typename ImageFactory<T>::data_type data_type;
+    typedef typename ImageFactory<T>::view_type view_type;
+    typedef typename view_type::value_type value_type;
+
+    if (factor < 1)
+        throw std::out_of_range("reduce_mean: factor must be at least 1");
+
+    size_t ncols = (src.ncols() + factor - 1) / factor;
+    size_t nrows = (src.nrows() + factor - 1) / factor;
+    data_type* data = new data_type(Dim(ncols, nrows), src.origin());
+    view_type* view = new view_type(*data);
+
+    vector<double> sums(ncols);
+    typename T::const_row_iterator row = src.row_begin();
+    typename view_type::row_iterator out_row = view->row_begin();
+    for (size_t y = 0; y < nrows; ++y, ++out_row) {
+        std::fill(sums.begin(), sums.end(), 0.0);
+        size_t block_rows = std::min(factor, src.nrows() - y * factor);
+        for (size_t k = 0; k < block_rows; ++k, ++row) {
+            size_t x = 0;
+            for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x)
+                sums[x / factor] += *col;
+        }
+        typename view_type::row_iterator::iterator out_col = out_row.begin();
+        for (size_t x = 0; x < ncols; ++x, ++out_col) {
+            size_t block_cols = std::min(factor, src.ncols() - x * factor);
+            *out_col = resample_pixel<value_type>(sums[x] / (double)(block_rows * block_cols));
+        }
+    }
+    return view;
+}
+
+
+/* this function enlarges an image reduced by "reduce_mean" by "factor" and
+   writes the part of the enlarged image with upper left corner "offset"
+   into "view", by bilinear interpolation. The pixel centres of the two
+   images are aligned, and the reduced image is extended by its border
+   pixels, so the enlarged image can be produced piece by piece.
+ */
+template<class T, class V>
+void expand_bilinear_core(const T &src, size_t factor, const Point &offset, V &view)
+{
+    typedef typename V::value_type value_type;
+
+    if (factor < 1)
+        throw std::out_of_range("expand_bilinear: factor must be at least 1");
+
+    // source columns and weights are the same for every row
+    size_t ncols = view.ncols();
+    vector<size_t> left(ncols), right(ncols);
+    vector<double> weight(ncols);
+    for (size_t x = 0; x < ncols; ++x) {
+        double u = ((double)(offset.x() + x) + 0.5) / (double)factor - 0.5;
+        u = std::max(0.0, std::min(u, (double)(src.ncols() - 1)));
+        left[x] = (size_t)u;
+        right[x] = std::min(left[x] + 1, src.ncols() - 1);
+        weight[x] = u - (double)left[x];
+    }
+
+    typename V::row_iterator out_row = view.row_begin();
+    for (size_t y = 0; y < view.nrows(); ++y, ++out_row) {
+        double v = ((double)(offset.y() + y) + 0.5) / (double)factor - 0.5;
+        v = std::max(0.0, std::min(v, (double)(src.nrows() - 1)));
+        size_t top = (size_t)v;
+        size_t bottom = std::min(top + 1, src.nrows() - 1);
+        double w = v - (double)top;
+
+        typename V::row_iterator::iterator out_col = out_row.begin();
+        for (size_t x = 0; x < ncols; ++x, ++out_col) {
+            double upper = (1.0 - weight[x]) * src.get(Point(left[x], top)) + weight[x] * src.get(Point(right[x], top));
+            double lower = (1.0 - weight[x]) * src.get(Point(left[x], bottom)) + weight[x] * src.get(Point(right[x], bottom));
+            *out_col = resample_pixel<value_type>((1.0 - w) * upper + w * lower);
+        }
+    }
+}
+
+
+/* this function enlarges an image reduced by "reduce_mean" back to "dim". */
+template<class T>
+typename ImageFactory<T>::view_type* expand_bilinear(const T &src, size_t factor, const Dim &dim)
+{
+    typedef typename ImageFactory<T>::data_type data_type;
+    typedef typename ImageFactory<T>::view_type view_type;
+
+    data_type* data = new data_type(dim);
+    view_type* view = new view_type(*data);
+    try {
+        expand_bilinear_core(src, factor, Point(0, 0), *view);
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
+    return view;
+}
+
+
+/* the columns (or rows) of an image of "n" pixels covered by each of the
+   "count" pixels of a reduction: pixel i covers [i*n/count, (i+1)*n/count),
+   and its sources are index[begin[i]] ... index[begin[i+1]-1], with the
+   part of each source it covers in "weight".
+ */
+struct area_spans
+{
+    vector<size_t> begin;
+    vector<size_t> index;
+    vector<double> weight;
+    vector<double> total;   // the sum of the weights of each pixel
+
+    area_spans(size_t n, size_t count) : begin(count + 1, 0), total(count, 0.0)
+    {
+        double step = (double)n / (double)count;
+        for (size_t i = 0; i < count; ++i) {
+            double start = i * step;
+            double end = (i + 1 == count) ? (double)n : (i + 1) * step;
+            size_t first = (size_t)start;
+            for (size_t k = first; (k < n) && ((double)k < end); ++k) {
+                double w = std::min(end, (double)(k + 1)) - std::max(start, (double)k);
+                if (w <= 0.0)
+                    continue;
+                index.push_back(k);
+                weight.push_back(w);
+                total[i] += w;
+            }
+            begin[i + 1] = index.size();
+        }
+    }
+};
+
+
+/* this function reduces an image to "dim" (at most the size of the image)
+   by area averaging: each pixel of the result is the mean of the part of
+   the image it covers, the pixels cut by its border being weighted by the
+   part covered. For an integer factor it is the mean of a block, as in
+   "reduce_mean".
+ * the image is read once, row by row: the rows are added into a line of
+   column sums with their weights (one pass over contiguous values per
+   row), and each finished line is reduced by the column spans.
+ */
+template<class T>
+typename ImageFactory<T>::view_type* reduce_area(const T &src, const Dim &dim)
+{
+    typedef typename ImageFactory<T>::data_type data_type;
+    typedef typename ImageFactory<T>::view_type view_type;
+    typedef typename view_type::value_type value_type;
+
+    if ((dim.ncols() < 1) || (dim.nrows() < 1) || (dim.ncols() > src.ncols()) || (dim.nrows() > src.nrows()))
+        throw std::out_of_range("reduce_area: the size must be between 1 and the size of the image");
+
+    data_type* data = new data_type(dim, src.origin());
+    view_type* view = new view_type(*data);
+    try {
+        area_spans columns(src.ncols(), dim.ncols());
+        area_spans rows(src.nrows(), dim.nrows());
+        vector<double> line(src.ncols());   // the source row rows.index[...] last read
+        vector<double> sums(src.ncols());
+        typename T::const_row_iterator row = src.row_begin();
+        size_t next = 0;                    // the index of "row"
+
+        typename view_type::row_iterator out_row = view->row_begin();
+        for (size_t y = 0; y < dim.nrows(); ++y, ++out_row) {
+            std::fill(sums.begin(), sums.end(), 0.0);
+            for (size_t k = rows.begin[y]; k < rows.begin[y + 1]; ++k) {
+                // a row shared with the previous pixel row is still in "line"
+                for (; next <= rows.index[k]; ++next, ++row) {
+                    size_t x = 0;
+                    for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x)
+                        line[x] = *col;
+                }
+                double w = rows.weight[k];
+                for (size_t x = 0; x < line.size(); ++x)
+                    sums[x] += w * line[x];
+            }
+
+            typename view_type::row_iterator::iterator out_col = out_row.begin();
+            for (size_t x = 0; x < dim.ncols(); ++x, ++out_col) {
+                double sum = 0.0;
+                for (size_t k = columns.begin[x]; k < columns.begin[x + 1]; ++k)
+                    sum += columns.weight[k] * sums[columns.index[k]];
+                *out_col = resample_pixel<value_type>(sum / (columns.total[x] * rows.total[y]));
+            }
+        }
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
+    return view;
+}
+
+
+/* this function enlarges "src" into "dest" by nearest neighbour, writing
+   each pixel of "dest" once: pixel x of a row of "dest" takes the column
+   of "src" under its centre, (2x+1)*src.ncols()/(2*dest.ncols()), and the
+   same for the rows.
+ */
+template<class T, class V>
+void expand_nearest(const T &src, V &dest)
+{
+    vector<size_t> columns(dest.ncols());
+    for (size_t x = 0; x < dest.ncols(); ++x)
+        columns[x] = std::min((2 * x + 1) * src.ncols() / (2 * dest.ncols()), src.ncols() - 1);
+
+    vector<typename T::value_type> line(src.ncols());
+    typename T::const_row_iterator row = src.row_begin();
+    size_t next = 0;                        // the index of "row"
+    typename V::row_iterator out_row = dest.row_begin();
+    for (size_t y = 0; y < dest.nrows(); ++y, ++out_row) {
+        size_t source = std::min((2 * y + 1) * src.nrows() / (2 * dest.nrows()), src.nrows() - 1);
+        for (; next <= source; ++next, ++row) {
+            size_t x = 0;
+            for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x)
+                line[x] = *col;
+        }
+        typename V::row_iterator::iterator out_col = out_row.begin();
+        for (size_t x = 0; x < dest.ncols(); ++x, ++out_col)
+            *out_col = line[columns[x]];
+    }
+}
+
+#endif
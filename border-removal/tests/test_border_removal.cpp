@@ -0,0 +1,490 @@
+/* checks of the border removal stages against the results they must
+   reproduce: the Gamera functions they replace, or a plain version of the
+   same operation.
+
+   build with the Gamera and Python headers, from this directory:
+     g++ -O2 -pthread -I../include/plugins -I<gamera>/include \
+         -I<python>/include test_border_removal.cpp -lpython<version> \
+         -o test_border_removal
+   and run ./test_border_removal; it prints the failed checks and returns
+   their number.
+ */
+#include "border_removal.hpp"
+#include "plugins/thinning.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace Gamera;
+using namespace std;
+
+static int failures=0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+
+template<class T>
+void delete_view(T* view)
+{
+  delete view->data();
+  delete view;
+}
+
+
+// the number of pixels where "a" and "b" differ, black against white for ONEBIT images
+template<class T, class U>
+size_t count_different(const T &a, const U &b)
+{
+  size_t different=0;
+  for (size_t y=0; y<a.nrows(); y++)
+    for (size_t x=0; x<a.ncols(); x++)
+      different+=(a.get(Point(x, y))!=b.get(Point(x, y)));
+  return different;
+}
+
+
+size_t count_different(const OneBitImageView &a, const OneBitImageView &b)
+{
+  size_t different=0;
+  for (size_t y=0; y<a.nrows(); y++)
+    for (size_t x=0; x<a.ncols(); x++)
+      different+=(is_black(a.get(Point(x, y)))!=is_black(b.get(Point(x, y))));
+  return different;
+}
+
+
+// ================= Thinning ======================
+
+/* thinning with Gamera's "thin_hs_one_pass", stopped after "iterations"
+   passes, as "lyric_extraction" did before it worked on packed rows: the
+   image is padded with one white pixel on each side.
+ */
+template<class T>
+OneBitImageView* thin_hs_passes(const T &src, int iterations)
+{
+  OneBitImageData thin_data(Dim(src.ncols()+2, src.nrows()+2));
+  OneBitImageView thin(thin_data);
+  for (size_t y=0; y<src.nrows(); y++)
+    for (size_t x=0; x<src.ncols(); x++)
+      thin.set(Point(x+1, y+1), src.get(Point(x, y)));
+  if ((src.nrows()>1) && (src.ncols()>1)) {
+    OneBitImageData hit_data(Dim(src.ncols()+2, src.nrows()+2));
+    OneBitImageView hit(hit_data);
+    for (int count=0; count<iterations; count++)
+      if (!thin_hs_one_pass(thin, hit))
+        break;
+  }
+  OneBitImageData* data=new OneBitImageData(src.size(), src.origin());
+  OneBitImageView* result=new OneBitImageView(*data);
+  for (size_t y=0; y<src.nrows(); y++)
+    for (size_t x=0; x<src.ncols(); x++)
+      result->set(Point(x, y), thin.get(Point(x+1, y+1)));
+  return result;
+}
+
+
+// a stroke of "width" pixels from (x, y) along (dx, dy), clipped to the image
+void draw_stroke(OneBitImageView &image, int x, int y, int dx, int dy, int length, int width)
+{
+  for (int k=0; k<length; k++)
+    for (int w=0; w<width; w++) {
+      int px=x+k*dx+w;
+      int py=y+k*dy;
+      if ((px>=0) && (py>=0) && (px<(int)image.ncols()) && (py<(int)image.nrows()))
+        image.set(Point(px, py), 1);
+    }
+}
+
+
+/* "lyric_extraction" thins on packed rows with the result of Gamera's
+   "thin_hs": to the end with 0 iterations, and after the same passes as
+   "thin_hs_one_pass" otherwise. The widths are around and between
+   multiples of 64, so the strokes cross the words of the packed rows, and
+   the images hold noise, filled blocks and diagonal strokes of both
+   directions.
+ */
+void test_thinning()
+{
+  size_t widths[]={1, 2, 3, 63, 64, 65, 100, 127, 129, 200};
+  for (size_t w=0; w<sizeof(widths)/sizeof(widths[0]); w++) {
+    for (int run=0; run<4; run++) {
+      srand(10*w+run);
+      size_t ncols=widths[w];
+      size_t nrows=1+rand()%90;
+      OneBitImageData image_data(Dim(ncols, nrows));
+      OneBitImageView image(image_data);
+      int density=(run%2==0) ? 10 : 60;
+      for (size_t y=0; y<nrows; y++)
+        for (size_t x=0; x<ncols; x++)
+          image.set(Point(x, y), (rand()%100<density) ? 1 : 0);
+      for (size_t y=nrows/4; y<nrows*3/4; y++)
+        for (size_t x=ncols/3; x<ncols*2/3; x++)
+          image.set(Point(x, y), 1);
+      for (int k=0; k<6; k++)
+        draw_stroke(image, rand()%(ncols+20)-10, rand()%nrows, (k%2==0) ? 1 : -1, 1, 10+rand()%80, 1+k%4);
+
+      OneBitImageView* thinned=lyric_extraction(image, 0);
+      OneBitImageView* reference=thin_hs(image);
+      CHECK(count_different(*thinned, *reference)==0);
+      delete_view(thinned);
+      delete_view(reference);
+      for (int iterations=1; iterations<=4; iterations++) {
+        thinned=lyric_extraction(image, iterations);
+        reference=thin_hs_passes(image, iterations);
+        CHECK(count_different(*thinned, *reference)==0);
+        delete_view(thinned);
+        delete_view(reference);
+      }
+    }
+  }
+}
+
+
+// ================= Reconstruction ======================
+
+/* greyscale reconstruction by its definition: the marker is dilated by one
+   pixel with connectivity "conn" and clipped by the mask until it does not
+   change.
+ */
+template<class T>
+void dilation_reconstruct(const T &mask, T &marker, int conn)
+{
+  int ncols=marker.ncols();
+  int nrows=marker.nrows();
+  bool changed=true;
+  while (changed) {
+    changed=false;
+    for (int y=0; y<nrows; y++) {
+      for (int x=0; x<ncols; x++) {
+        typename T::value_type value=marker.get(Point(x, y));
+        for (int dy=-1; dy<=1; dy++)
+          for (int dx=-1; dx<=1; dx++) {
+            if (((conn==4) && (dx!=0) && (dy!=0)) || (x+dx<0) || (y+dy<0) || (x+dx>=ncols) || (y+dy>=nrows))
+              continue;
+            value=max(value, marker.get(Point(x+dx, y+dy)));
+          }
+        value=min(value, mask.get(Point(x, y)));
+        if (value!=marker.get(Point(x, y))) {
+          marker.set(Point(x, y), value);
+          changed=true;
+        }
+      }
+    }
+  }
+}
+
+
+/* a mask of random levels up to "top", and a marker that is the mask on
+   a few pixels and 0 elsewhere.
+ */
+template<class T>
+void make_reconstruction(T &mask, T &marker, unsigned int top, unsigned int seed)
+{
+  srand(seed);
+  for (size_t y=0; y<mask.nrows(); y++)
+    for (size_t x=0; x<mask.ncols(); x++) {
+      typename T::value_type value=(typename T::value_type)(rand()%(top+1));
+      mask.set(Point(x, y), value);
+      marker.set(Point(x, y), ((x+y)%7==0) ? value : 0);
+    }
+}
+
+
+template<class T>
+size_t reconstruction_differences(size_t ncols, size_t nrows, unsigned int top, unsigned int seed, int conn)
+{
+  typedef typename ImageFactory<T>::data_type data_type;
+  data_type mask_data(Dim(ncols, nrows));
+  T mask(mask_data);
+  data_type marker_data(Dim(ncols, nrows));
+  T marker(marker_data);
+  make_reconstruction(mask, marker, top, seed);
+  data_type reference_data(Dim(ncols, nrows));
+  T reference(reference_data);
+  copy(marker.vec_begin(), marker.vec_end(), reference.vec_begin());
+  reconstruct(mask, marker, conn);
+  dilation_reconstruct(mask, reference, conn);
+  return count_different(marker, reference);
+}
+
+
+/* "reconstruct" gives the reconstruction by its definition for the pixel
+   types and connectivities of the flood fills, and "flood_fill_holes_grey"
+   fills as its definition the inside of a spiral, whose corridor from the
+   border winds up and left.
+ */
+void test_reconstruction()
+{
+  for (int run=0; run<12; run++) {
+    for (int conn=4; conn<=8; conn+=4) {
+      CHECK(reconstruction_differences<GreyScaleImageView>(37+run, 23+2*run, 255, run, conn)==0);
+      CHECK(reconstruction_differences<Grey16ImageView>(5+run, 30, 65535, run, conn)==0);
+      CHECK(reconstruction_differences<OneBitImageView>(31, 17+run, 1, run, conn)==0);
+    }
+  }
+
+  const char* spiral[]={"000000000000",
+                        "011111111110",
+                        "000000000010",
+                        "011111111010",
+                        "010000001010",
+                        "010111101010",
+                        "010100001010",
+                        "010111111010",
+                        "010000000010",
+                        "011111111110",
+                        "000000000000"};
+  size_t nrows=sizeof(spiral)/sizeof(spiral[0]);
+  size_t ncols=strlen(spiral[0]);
+  GreyScaleImageData page_data(Dim(ncols, nrows));
+  GreyScaleImageView page(page_data);
+  for (size_t y=0; y<nrows; y++)
+    for (size_t x=0; x<ncols; x++)
+      page.set(Point(x, y), (spiral[y][x]=='1') ? 40 : 200);
+  for (int conn=4; conn<=8; conn+=4) {
+    GreyScaleImageView* filled=flood_fill_holes_grey(page, conn);
+    GreyScaleImageView* mask=flood_mask_grey(page);
+    GreyScaleImageView* marker=flood_marker_grey(page);
+    dilation_reconstruct(*mask, *marker, conn);
+    invert(*marker);
+    GreyScaleImageView reference(*marker->data(), Point(marker->ul_x()+1, marker->ul_y()+1), Dim(ncols, nrows));
+    CHECK(count_different(*filled, reference)==0);
+    delete_view(filled);
+    delete_view(mask);
+    delete_view(marker);
+  }
+
+  bool thrown=false;
+  try {
+    flood_fill_holes_grey(page, 6);
+  } catch (std::invalid_argument &e) {
+    thrown=true;
+  }
+  CHECK(thrown);
+}
+
+
+// the number of pixels where "reconstruct" on "pool" differs from the serial reconstruction
+template<class T>
+size_t band_differences(const T &mask, const T &marker, int conn, thread_pool &pool)
+{
+  typedef typename ImageFactory<T>::data_type data_type;
+  data_type banded_data(marker.size(), marker.origin());
+  T banded(banded_data);
+  copy(marker.vec_begin(), marker.vec_end(), banded.vec_begin());
+  data_type serial_data(marker.size(), marker.origin());
+  T serial(serial_data);
+  copy(marker.vec_begin(), marker.vec_end(), serial.vec_begin());
+  reconstruct(mask, banded, conn, pool);
+  reconstruct(mask, serial, conn);
+  return count_different(banded, serial);
+}
+
+
+/* "reconstruct" on a pool of 2 to 8 threads, by bands of rows, gives the
+   serial reconstruction: for random images, and for a serpentine corridor
+   that the marker follows from one corner across every band boundary,
+   down and up again. "flood_fill_holes_grey" on a pool gives its serial
+   result too.
+ */
+void test_reconstruction_bands()
+{
+  size_t threads[]={2, 3, 4, 8};
+  for (size_t t=0; t<sizeof(threads)/sizeof(threads[0]); t++) {
+    thread_pool pool(threads[t]);
+    for (int conn=4; conn<=8; conn+=4) {
+      for (int run=0; run<3; run++) {
+        GreyScaleImageData mask_data(Dim(57+run, 300+97*run));
+        GreyScaleImageView mask(mask_data);
+        GreyScaleImageData marker_data(Dim(57+run, 300+97*run));
+        GreyScaleImageView marker(marker_data);
+        make_reconstruction(mask, marker, 255, run);
+        CHECK(band_differences(mask, marker, conn, pool)==0);
+
+        Grey16ImageData mask16_data(Dim(13, 256+run));
+        Grey16ImageView mask16(mask16_data);
+        Grey16ImageData marker16_data(Dim(13, 256+run));
+        Grey16ImageView marker16(marker16_data);
+        make_reconstruction(mask16, marker16, 65535, run);
+        CHECK(band_differences(mask16, marker16, conn, pool)==0);
+      }
+
+      size_t ncols=63;
+      size_t nrows=600;
+      OneBitImageData corridor_data(Dim(ncols, nrows));
+      OneBitImageView corridor(corridor_data);
+      OneBitImageData seed_data(Dim(ncols, nrows));
+      OneBitImageView seed(seed_data);
+      for (size_t y=0; y<nrows; y++)
+        for (size_t x=0; x<ncols; x++) {
+          bool gap=((x/4)%2==0) ? (y==nrows-1) : (y==0);
+          corridor.set(Point(x, y), ((x%4==2) && !gap) ? 0 : 1);
+          seed.set(Point(x, y), ((x==0) && (y==0)) ? 1 : 0);
+        }
+      CHECK(band_differences(corridor, seed, conn, pool)==0);
+
+      GreyScaleImageData page_data(Dim(150, 500));
+      GreyScaleImageView page(page_data);
+      srand(threads[t]);
+      for (size_t y=0; y<page.nrows(); y++)
+        for (size_t x=0; x<page.ncols(); x++)
+          page.set(Point(x, y), rand()%256);
+      GreyScaleImageView* banded=flood_fill_holes_grey(page, conn, pool);
+      GreyScaleImageView* serial=flood_fill_holes_grey(page, conn);
+      CHECK(count_different(*banded, *serial)==0);
+      delete_view(banded);
+      delete_view(serial);
+    }
+  }
+}
+
+
+// ================= Edge Combination ======================
+
+/* "edge_combine" as it was with Gamera's "cc_analysis": the connected
+   components of the 2nd edge map longer than scale_length times the
+   longer side of the image are added to the 1st edge map.
+ */
+template<class T>
+OneBitImageView* edge_combine_cc(const T &src, const T &src2, double scale_length)
+{
+  double max_length=scale_length*((src.ncols()>src.nrows()) ? src.ncols() : src.nrows());
+  OneBitImageView* edge_view=to_logical(src);
+  OneBitImageView* edge2_view=to_logical(src2);
+  ImageList* ccs=cc_analysis(*edge2_view);
+  for (ImageList::iterator i=ccs->begin(); i!=ccs->end(); i++) {
+    ConnectedComponent<OneBitImageData>* cc=static_cast<ConnectedComponent<OneBitImageData>*>(*i);
+    size_t length=(cc->ncols()>cc->nrows()) ? cc->ncols() : cc->nrows();
+    if (length>max_length) {
+      OneBitImageView edge_cc(*edge_view->data(), cc->origin(), cc->size());
+      for (size_t y=0; y<cc->nrows(); y++)
+        for (size_t x=0; x<cc->ncols(); x++)
+          if (cc->get(Point(x, y))!=0)
+            edge_cc.set(Point(x, y), 1);
+    }
+    delete *i;
+  }
+  delete ccs;
+  delete_view(edge2_view);
+  return edge_view;
+}
+
+
+/* "edge_combine" labels the 2nd edge map by runs with the components of
+   "cc_analysis": for random edge maps with straight and diagonal lines,
+   whose components touch at corners, and thresholds from 0 to the whole
+   image.
+ */
+void test_edge_combine()
+{
+  for (int run=0; run<200; run++) {
+    srand(run);
+    size_t ncols=1+rand()%120;
+    size_t nrows=1+rand()%120;
+    int density=rand()%100;
+    GreyScaleImageData edges_data(Dim(ncols, nrows));
+    GreyScaleImageView edges(edges_data);
+    GreyScaleImageData edges2_data(Dim(ncols, nrows));
+    GreyScaleImageView edges2(edges2_data);
+    for (size_t y=0; y<nrows; y++)
+      for (size_t x=0; x<ncols; x++) {
+        edges.set(Point(x, y), (rand()%100<10) ? 0 : 255);
+        edges2.set(Point(x, y), (rand()%100<density) ? rand()%2 : 200);
+      }
+    for (int k=rand()%5; k>0; k--) {
+      size_t x=rand()%ncols;
+      size_t y=rand()%nrows;
+      size_t length=rand()%100;
+      int direction=rand()%3;
+      for (size_t j=0; j<length; j++) {
+        size_t px=x+((direction!=1) ? j : 0);
+        size_t py=y+((direction!=0) ? j : 0);
+        if ((px<ncols) && (py<nrows))
+          edges2.set(Point(px, py), 1);
+      }
+    }
+    double scale_length=(rand()%40)/100.0;
+
+    OneBitImageView* combined=edge_combine(edges, edges2, scale_length);
+    OneBitImageView* reference=edge_combine_cc(edges, edges2, scale_length);
+    CHECK(count_different(*combined, *reference)==0);
+    delete_view(combined);
+    delete_view(reference);
+  }
+}
+
+
+// ================= Running Filters ======================
+
+/* "erode_dilate_square" gives Gamera's "erode_dilate" with a square, and
+   "box_mean" its "mean_filter", for images from 1x1 on, so that images
+   smaller than 3x3 and squares larger than the image are covered, and
+   "box_mean" rejects regions larger than the image.
+ */
+void test_running_filters()
+{
+  for (int run=0; run<200; run++) {
+    srand(run);
+    size_t ncols=1+rand()%90;
+    size_t nrows=1+rand()%90;
+    size_t times=rand()%12;
+    int direction=rand()%2;
+    GreyScaleImageData page_data(Dim(ncols, nrows));
+    GreyScaleImageView page(page_data);
+    Grey16ImageData page16_data(Dim(ncols, nrows));
+    Grey16ImageView page16(page16_data);
+    for (size_t y=0; y<nrows; y++)
+      for (size_t x=0; x<ncols; x++) {
+        page.set(Point(x, y), rand()%256);
+        page16.set(Point(x, y), rand()%65536);
+      }
+
+    GreyScaleImageView* running=erode_dilate_square(page, times, direction);
+    GreyScaleImageView* reference=erode_dilate(page, times, direction, 0);
+    CHECK(count_different(*running, *reference)==0);
+    delete_view(running);
+    delete_view(reference);
+
+    Grey16ImageView* running16=erode_dilate_square(page16, times, direction);
+    Grey16ImageView* reference16=erode_dilate(page16, times, direction, 0);
+    CHECK(count_different(*running16, *reference16)==0);
+    delete_view(running16);
+    delete_view(reference16);
+
+    size_t region_size=1+rand()%min(ncols, nrows);
+    FloatImageView* mean=box_mean(page, region_size);
+    FloatImageView* mean_reference=mean_filter(page, region_size);
+    CHECK(count_different(*mean, *mean_reference)==0);
+    delete_view(mean);
+    delete_view(mean_reference);
+  }
+
+  GreyScaleImageData small_data(Dim(5, 5));
+  GreyScaleImageView small(small_data);
+  bool thrown=false;
+  try {
+    box_mean(small, 6);
+  } catch (std::out_of_range &e) {
+    thrown=true;
+  }
+  CHECK(thrown);
+}
+
+
+int main()
+{
+  test_thinning();
+  test_reconstruction();
+  test_reconstruction_bands();
+  test_edge_combine();
+  test_running_filters();
+  printf("%d failed checks\n", failures);
+  return failures;
+}
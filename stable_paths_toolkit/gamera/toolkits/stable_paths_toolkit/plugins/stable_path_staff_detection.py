@@ -69,6 +69,21 @@ class stablePathDetection(PluginFunction):
         return _stable_path_staff_detection.stablePathDetection(self, with_trimming, with_deletion, with_staff_fixing, enable_strong_staff_pixels, staffline_height, staffspace_height)
     __call__ = staticmethod(__call__)
 
+class stablePathDetection_with_accounting(PluginFunction):
+    """Same as stablePathDetection, and also records the memory allocated by each stage of the detection. Returns the tuple (image, accounting).
+        accounting:
+            A dict with the page size, the total bytes allocated, the number of allocations and the high-water mark of the bytes held ("bytes", "allocations", "peak"), and the same for each stage in "stages", in the order the stages ran.
+        json_file:
+            If not empty, the accounting is also appended to this file as one line of JSON, so a batch leaves one line per page."""
+    category = "Stable Paths Toolkit"
+    return_type = Class("result")
+    self_type = ImageType([ONEBIT])
+    args = Args([Bool('with_trimming', default = True), Bool('with_deletion', default = False), Bool('with_staff_fixing', default = False), Bool('enable_strong_staff_pixels', default = False), Int('staffline_height', default=0),\
+                 Int('staffspace_height', default=0), String('json_file', default="")])
+    def __call__(self, with_trimming=True, with_deletion=False, with_staff_fixing=False, enable_strong_staff_pixels=False, staffline_height=0, staffspace_height=0, json_file=""):
+        return _stable_path_staff_detection.stablePathDetection_with_accounting(self, with_trimming, with_deletion, with_staff_fixing, enable_strong_staff_pixels, staffline_height, staffspace_height, json_file)
+    __call__ = staticmethod(__call__)
+
 class subimageStablePathDetection(PluginFunction):
     """Displays the trimmed stable paths for a subset of the image
         with_trimming:
@@ -162,7 +177,7 @@ class stablePaths(PluginModule):
     cpp_headers=["stable_path_staff_detection.hpp"]
     cpp_namespace=["Gamera"]
     category = "Stable_paths_toolkit"
-    functions = [stablePathDetection, drawAllGraphPaths, overlayStaves, subimageStablePathDetection, setOfStablePathPoints, deleteStablePaths, findStablePaths, removeStaves, displayWeights, drawAllStablePaths, get_stable_path_staff_skeletons]
+    functions = [stablePathDetection, stablePathDetection_with_accounting, drawAllGraphPaths, overlayStaves, subimageStablePathDetection, setOfStablePathPoints, deleteStablePaths, findStablePaths, removeStaves, displayWeights, drawAllStablePaths, get_stable_path_staff_skeletons]
     author = "Ian Karp"
     url = "Your URL here"
 module = stablePaths()
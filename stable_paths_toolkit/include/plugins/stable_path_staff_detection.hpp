@@ -38,6 +38,9 @@
 #include <string>
 #include "gameramodule.hpp"
 #include "gamera.hpp"
+#include "memory_accounting.hpp"
+#include "packed_rows.hpp"
+#include "packed_morphology.hpp"
 
 
 #include <time.h>
@@ -102,6 +105,7 @@ public:
     NODE* graphPath; //Will contain the path of stable paths
     NODEGRAPH* graphWeight; //Will contain the weight/cost of moving from one pixel to the upper right, right, or lower right
     bool* strongStaffPixels; //Array indicating which points are strong staff-pixels
+    size_t tableBytes; //Bytes of the per-pixel tables above, charged to the active memory accounting
     
     bool enableSSP; //Will determine whether strong staff-pixels are calculated
     
@@ -145,7 +149,7 @@ public:
     template<class T>
     OneBitImageView* clear(T& image)
     {
-        OneBitImageData* dest_data = new OneBitImageData(image.size());
+        OneBitImageData* dest_data = account_data(new OneBitImageData(image.size()));
         OneBitImageView* dest_view = new OneBitImageView(*dest_data);
         
         for (size_t r = 0; r < image.nrows(); r++)
@@ -162,7 +166,7 @@ public:
     template<class T>
     GreyScaleImageView* clearGrey(T& image)
     {
-        GreyScaleImageData* dest_data = new GreyScaleImageData(image.size());
+        GreyScaleImageData* dest_data = account_data(new GreyScaleImageData(image.size()));
         GreyScaleImageView* dest_view = new GreyScaleImageView(*dest_data);
         
         for (size_t r = 0; r < image.nrows(); r++)
@@ -179,7 +183,7 @@ public:
     template<class T>
     OneBitImageView* myCloneImage(T &image)
     {
-        OneBitImageData* dest_data = new OneBitImageData(image.size());
+        OneBitImageData* dest_data = account_data(new OneBitImageData(image.size()));
         OneBitImageView* dest_view = new OneBitImageView(*dest_data);
         
         for (size_t r = 0; r < image.nrows(); r++)
@@ -193,42 +197,13 @@ public:
         return dest_view;
     }
     
-    void myVerticalErodeImage(OneBitImageView * img, int width, int height)
+    //Sets each pixel to the OR of itself and the pixels above and below it (a vertical dilation by one pixel), on packed rows
+    void myVerticalErodeImage(OneBitImageView * img)
     {
-        unsigned char pel_prev;
-        unsigned char pel_curr;
-        unsigned char pel_next;
-        
-        for (int c = 0; c < width; c++)
-        {
-            pel_prev = img->get(getPointView(c, width, height));
-            pel_curr = img->get(getPointView(c, width, height));
-            
-            for (int r = 0; r < height - 1; r++)
-            {
-                int curr_pixel = (r * width) + c;
-                //printf("Current Point: (%d, %d) Current Pixel Value: (%d/ %d)", c, r, curr_pixel, width*height);
-                int next_row_pixel = ((r + 1) * width) + c;
-                pel_next = img->get(getPointView(next_row_pixel, width, height));
-                
-                if (pel_prev || pel_curr || pel_next)
-                {
-                    img->set(getPointView(curr_pixel, width, height), 1);
-                }
-                
-                pel_prev = pel_curr;
-                pel_curr = pel_next;
-            }
-            
-            if (pel_prev || pel_curr)
-            {
-                img->set(getPointView(((height - 1) * width) + c, width, height), 1);
-            }
-            else
-            {
-                img->set(getPointView(((height - 1) * width) + c, width, height), 0);
-            }
-        }
+        packed_image rows;
+        pack_rows(*img, rows);
+        dilate_packed(rows, 0, 1);
+        unpack_rows(rows, *img);
     }
     
     void printPoint(Point p)
@@ -275,6 +250,8 @@ public:
         graphWeight = new NODEGRAPH[imageWidth * imageHeight];
         verRun = new int[imageWidth * imageHeight];
         verDistance = new int[imageWidth * imageHeight];
+        tableBytes = imageWidth * imageHeight * (sizeof(NODE) + sizeof(NODEGRAPH) + 2 * sizeof(int));
+        account_bytes(tableBytes);
         memset (verDistance, 0, (sizeof(int) * imageWidth * imageHeight));
         
         enableSSP = enableSSP1;
@@ -288,6 +265,7 @@ public:
         graphWeight = new NODEGRAPH[0];
         verRun = new int[0];
         verDistance = new int[0];
+        tableBytes = 0;
     }
     
     ~stableStaffLineFinder ()
@@ -298,6 +276,7 @@ public:
         //delete img;
         delete verRun;
         delete verDistance;
+        release_bytes(tableBytes);
         //printf ("\tGLOBAL TIME %d\n\n", time (0)-globalStart);
     }
     
@@ -412,6 +391,7 @@ public:
         if (enableSSP)
         {
             strongStaffPixels = new bool[imageWidth * imageHeight];
+            account_bytes(imageWidth * imageHeight * sizeof(bool));
             //cout <<"SSP enabled" <<endl;
             determineStrongStaffPixels();
         }
@@ -631,8 +611,8 @@ public:
         OneBitImageView *imageCopy = myCloneImage(*primaryImage);
         OneBitImageView *imgErode = myCloneImage(*primaryImage);
         OneBitImageView *imageErodedCopy = myCloneImage(*primaryImage);
-        myVerticalErodeImage(imgErode, imageWidth, imageHeight);
-        myVerticalErodeImage(imageErodedCopy, imageWidth, imageHeight);
+        myVerticalErodeImage(imgErode);
+        myVerticalErodeImage(imageErodedCopy);
         
         vector<int> npaths;
         
@@ -842,10 +822,8 @@ public:
             printf("TOTAL = %lu TOTAL STAFF LINES\n", validStaves.size());
         }
         
-        delete imgErode->data();
-        delete imageErodedCopy->data();
-        delete imgErode;
-        delete imageErodedCopy;
+        release_image(imgErode);
+        release_image(imageErodedCopy);
         
         return imageCopy;
     }
@@ -1221,8 +1199,8 @@ public:
         OneBitImageView *imageCopy = myCloneImage(image);
         OneBitImageView *imgErode = myCloneImage(image);
         OneBitImageView *imageErodedCopy = myCloneImage(image);
-        myVerticalErodeImage(imgErode, image.ncols(), image.nrows());
-        myVerticalErodeImage(imageErodedCopy, image.ncols(), image.nrows());
+        myVerticalErodeImage(imgErode);
+        myVerticalErodeImage(imageErodedCopy);
         
         vector<int> npaths;
         
@@ -2532,6 +2510,7 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
 {
     if (with_deletion)
     {
+        accounting_stage stage("graph");
         stableStaffLineFinder slf1 (image, enable_strong_staff_pixels);
         
         if (staffline_height)
@@ -2544,17 +2523,23 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
             slf1.staffSpaceDistance = staffspace_height;
         }
         
-        RGBImageData *data1 = new RGBImageData(image.size());
+        stage.next("output");
+        RGBImageData *data1 = account_data(new RGBImageData(image.size()));
         RGBImageView *new1 = new RGBImageView(*data1);
         vector<vector <Point> > validStaves;
+        stage.next("detection");
         OneBitImageView *firstPass = slf1.stableStaffDetection(validStaves);
+        stage.next("subtraction");
         OneBitImageView *subtractedImage = slf1.subtractImage(image, *firstPass);
         validStaves.clear();
+        stage.next("second graph");
         stableStaffLineFinder slf2 (*subtractedImage, enable_strong_staff_pixels);
         vector< vector <vector<Point> > > setsOfValidStaves;
+        stage.next("second detection");
         setsOfValidStaves = slf2.returnSetsOfStablePaths(validStaves, *subtractedImage);
         vector< vector <vector<Point> > > setsToReturn;
         //cout <<"About to commence finalTrim" <<endl;
+        stage.next("trimming");
         
         if (with_trimming)
         {
@@ -2566,6 +2551,7 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
         }
         
         //cout <<"Finished finalTrim" <<endl;
+        stage.next("drawing");
         int redCount, blueCount, greenCount, counter;
         redCount = blueCount = greenCount = counter = 0;
         
@@ -2616,6 +2602,7 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
     }
     else
     {
+        accounting_stage stage("graph");
         stableStaffLineFinder slf1 (image, enable_strong_staff_pixels);
         
         if (staffline_height)
@@ -2628,13 +2615,16 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
             slf1.staffSpaceDistance = staffspace_height;
         }
         
-        RGBImageData *data1 = new RGBImageData(image.size());
+        stage.next("output");
+        RGBImageData *data1 = account_data(new RGBImageData(image.size()));
         RGBImageView *new1 = new RGBImageView(*data1);
         vector<vector <Point> > validStaves;
         vector< vector <vector<Point> > > setsOfValidStaves;
+        stage.next("detection");
         setsOfValidStaves = slf1.returnSetsOfStablePaths(validStaves, *slf1.primaryImage);
         vector< vector <vector<Point> > > setsToReturn;
         //cout <<"About to commence finalTrim" <<endl;
+        stage.next("trimming");
         
         if (with_trimming)
         {
@@ -2645,6 +2635,7 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
             setsToReturn = setsOfValidStaves;
         }
         //cout <<"Finished finalTrim" <<endl;
+        stage.next("drawing");
         int redCount, blueCount, greenCount, counter;
         redCount = blueCount = greenCount = counter = 0;
         
@@ -2696,6 +2687,20 @@ RGBImageView* stablePathDetection(T &image, bool with_trimming, bool with_deleti
     }
 }
 
+//Same as stablePathDetection, and also returns the memory allocated by each stage as a dict (see memory_accounting.hpp) in the tuple (image, accounting). If json_file is not empty, the accounting is appended to it as a line of JSON
+template<class T>
+PyObject* stablePathDetection_with_accounting(T &image, bool with_trimming, bool with_deletion, bool with_staff_fixing, bool enable_strong_staff_pixels, int staffline_height, int staffspace_height, const char* json_file)
+{
+    memory_accounting accounting("stablePathDetection");
+    accounting.page(image.ncols(), image.nrows());
+    RGBImageView *result;
+    {
+        accounting_scope scope(accounting);
+        result = stablePathDetection(image, with_trimming, with_deletion, with_staff_fixing, enable_strong_staff_pixels, staffline_height, staffspace_height);
+    }
+    return accounted_result(result, accounting, json_file);
+}
+
 template<class T>
 PyObject* setOfStablePathPoints(T &image, bool with_trimming, bool with_deletion, bool with_staff_fixing, bool enable_strong_staff_pixels, int staffline_height, int staffspace_height)
 {
@@ -0,0 +1,187 @@
+#ifndef PACKED_MORPHOLOGY_HPP
+#define PACKED_MORPHOLOGY_HPP
+
+#include "gamera.hpp"
+#include "packed_rows.hpp"
+
+#include <vector>
+#include <algorithm>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Packed Binary Morphology =======================
+/* dilation and erosion of packed binary images (see "packed_rows.hpp") by
+   rectangles, one direction at a time: a row is moved sideways by word
+   shifts, and rows are combined a word at a time, so 64 pixels are done
+   by each operation.
+ * a rectangle of half sizes (rx, ry) covers the pixels [x-rx, x+rx] x
+   [y-ry, y+ry]. A window of 2r+1 is built from the window of 2c+1 by
+   moving it s <= c+1 pixels both ways, so it takes about log2(r) steps.
+ */
+
+// dest |= the row moved "shift" pixels to the right (to the higher columns)
+inline void or_shifted_right_by(const packed_word* row, packed_word* dest, size_t words, size_t shift)
+{
+    size_t q = shift / 64;
+    size_t r = shift % 64;
+    for (size_t w = words; w > q; --w) {
+        size_t from = w - 1 - q;
+        packed_word bits = row[from] << r;
+        if ((r > 0) && (from > 0))
+            bits |= row[from - 1] >> (64 - r);
+        dest[w - 1] |= bits;
+    }
+}
+
+
+// dest |= the row moved "shift" pixels to the left (to the lower columns)
+inline void or_shifted_left_by(const packed_word* row, packed_word* dest, size_t words, size_t shift)
+{
+    size_t q = shift / 64;
+    size_t r = shift % 64;
+    for (size_t w = 0; w + q < words; ++w) {
+        size_t from = w + q;
+        packed_word bits = row[from] >> r;
+        if ((r > 0) && (from + 1 < words))
+            bits |= row[from + 1] << (64 - r);
+        dest[w] |= bits;
+    }
+}
+
+
+/* this function dilates the rows of "image" by [-rx, rx] in place. The
+   pixels outside the image are white.
+ */
+inline void dilate_packed_rows(packed_image &image, size_t rx)
+{
+    size_t words = image.words();
+    packed_word last = image.last_mask();
+    vector<packed_word> grown(words);
+    for (size_t y = 0; y < image.nrows(); ++y) {
+        packed_word* row = image.row(y);
+        for (size_t c = 0; c < rx; ) {
+            size_t s = std::min(c + 1, rx - c);
+            std::copy(row, row + words, grown.begin());
+            or_shifted_right_by(row, &grown[0], words, s);
+            or_shifted_left_by(row, &grown[0], words, s);
+            std::copy(grown.begin(), grown.end(), row);
+            row[words - 1] &= last;
+            c += s;
+        }
+    }
+}
+
+
+/* this function dilates the columns of "image" by [-ry, ry] in place. The
+   pixels outside the image are white.
+ */
+inline void dilate_packed_columns(packed_image &image, size_t ry)
+{
+    size_t words = image.words();
+    size_t nrows = image.nrows();
+    packed_image grown(image.ncols(), nrows);
+    for (size_t c = 0; c < ry; ) {
+        size_t s = std::min(c + 1, ry - c);
+        for (size_t y = 0; y < nrows; ++y) {
+            packed_word* dest = grown.row(y);
+            const packed_word* row = image.row(y);
+            const packed_word* above = (y >= s) ? image.row(y - s) : NULL;
+            const packed_word* below = (y + s < nrows) ? image.row(y + s) : NULL;
+            for (size_t w = 0; w < words; ++w)
+                dest[w] = row[w] | (above ? above[w] : 0) | (below ? below[w] : 0);
+        }
+        std::swap(image, grown);
+        c += s;
+    }
+}
+
+
+// the complement of the pixels of "image" in place; the bits past the last column stay 0
+inline void invert_packed(packed_image &image)
+{
+    size_t words = image.words();
+    packed_word last = image.last_mask();
+    for (size_t y = 0; y < image.nrows(); ++y) {
+        packed_word* row = image.row(y);
+        for (size_t w = 0; w < words; ++w)
+            row[w] = ~row[w];
+        row[words - 1] &= last;
+    }
+}
+
+
+/* this function dilates "image" in place by the rectangle of half sizes
+   (rx, ry). The pixels outside the image are white.
+ */
+inline void dilate_packed(packed_image &image, size_t rx, size_t ry)
+{
+    if ((image.words() == 0) || (image.nrows() == 0))
+        return;
+    dilate_packed_rows(image, rx);
+    dilate_packed_columns(image, ry);
+}
+
+
+/* this function erodes "image" in place by the rectangle of half sizes
+   (rx, ry): a pixel stays black when the whole rectangle around it is
+   black. The pixels outside the image are white, so the pixels closer
+   than the rectangle to the border become white, unless "outside_black"
+   is true, in which case the rectangle is clipped at the border.
+ */
+inline void erode_packed(packed_image &image, size_t rx, size_t ry, bool outside_black=false)
+{
+    if ((image.words() == 0) || (image.nrows() == 0))
+        return;
+    invert_packed(image);
+    dilate_packed(image, rx, ry);
+    invert_packed(image);
+    if (outside_black)
+        return;
+    for (size_t y = 0; y < image.nrows(); ++y) {
+        packed_word* row = image.row(y);
+        if ((y < ry) || (y + ry >= image.nrows())) {
+            std::fill(row, row + image.words(), 0);
+            continue;
+        }
+        for (size_t x = 0; (x < rx) && (x < image.ncols()); ++x) {
+            image.set(x, y, false);
+            image.set(image.ncols() - 1 - x, y, false);
+        }
+    }
+}
+
+
+/* this function dilates (direction 0) or erodes (direction 1) a ONEBIT
+   image with a square of (2*times+1)^2 pixels on packed rows, as Gamera's
+   "erode_dilate(src, times, direction, 0)": the pixels outside the image
+   are white, and images smaller than 3x3 are copied.
+ */
+template<class T>
+typename ImageFactory<T>::view_type* erode_dilate_packed(const T &src, size_t times, int direction)
+{
+    typedef typename ImageFactory<T>::data_type data_type;
+    typedef typename ImageFactory<T>::view_type view_type;
+
+    data_type* data = new data_type(src.size(), src.origin());
+    view_type* view = new view_type(*data);
+    try {
+        packed_image image;
+        pack_rows(src, image);
+        if ((src.nrows() >= 3) && (src.ncols() >= 3)) {
+            if (direction == 0)
+                dilate_packed(image, times, times);
+            else
+                erode_packed(image, times, times);
+        }
+        unpack_rows(image, *view);
+    } catch (std::exception e) {
+        delete view;
+        delete data;
+        throw;
+    }
+    return view;
+}
+
+#endif
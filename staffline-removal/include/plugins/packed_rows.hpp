@@ -0,0 +1,177 @@
+#ifndef PACKED_ROWS_HPP
+#define PACKED_ROWS_HPP
+
+#include "gamera.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+using namespace Gamera;
+using namespace std;
+
+
+// ===================== Packed Binary Rows =======================
+/* a binary image stored as rows of 64-bit words, one bit per pixel. Pixel
+   x of a row is bit x%64 of word x/64, so shifting a word left moves its
+   pixels to the right. The bits past the last column are always 0.
+ */
+typedef uint64_t packed_word;
+
+class packed_image
+{
+public:
+    packed_image() : m_ncols(0), m_nrows(0), m_words(0) {}
+    packed_image(size_t ncols, size_t nrows) { resize(ncols, nrows); }
+
+    // resizes the image and clears all the pixels
+    void resize(size_t ncols, size_t nrows)
+    {
+        m_ncols = ncols;
+        m_nrows = nrows;
+        m_words = (ncols + 63) / 64;
+        m_bits.assign(m_words * nrows, 0);
+    }
+
+    size_t ncols() const { return m_ncols; }
+    size_t nrows() const { return m_nrows; }
+    // the number of words in a row
+    size_t words() const { return m_words; }
+    size_t bytes() const { return m_bits.size() * sizeof(packed_word); }
+
+    packed_word* row(size_t y) { return &m_bits[y * m_words]; }
+    const packed_word* row(size_t y) const { return &m_bits[y * m_words]; }
+
+    bool get(size_t x, size_t y) const
+    {
+        return (row(y)[x / 64] >> (x % 64)) & 1;
+    }
+
+    void set(size_t x, size_t y, bool value)
+    {
+        packed_word bit = (packed_word)1 << (x % 64);
+        if (value)
+            row(y)[x / 64] |= bit;
+        else
+            row(y)[x / 64] &= ~bit;
+    }
+
+    // the valid bits of the last word of a row
+    packed_word last_mask() const
+    {
+        return (m_ncols % 64 == 0) ? ~(packed_word)0 : ((packed_word)1 << (m_ncols % 64)) - 1;
+    }
+
+private:
+    size_t m_ncols, m_nrows, m_words;
+    vector<packed_word> m_bits;
+};
+
+
+/* this function packs a ONEBIT image: a bit is set where the pixel is
+   black, or where it is white if "black" is false.
+ */
+template<class T>
+void pack_rows(const T &src, packed_image &dest, bool black = true)
+{
+    dest.resize(src.ncols(), src.nrows());
+    typename T::const_row_iterator row = src.row_begin();
+    for (size_t y = 0; y < src.nrows(); ++y, ++row) {
+        packed_word* bits = dest.row(y);
+        size_t x = 0;
+        for (typename T::const_row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x) {
+            if (is_black(*col) == black)
+                bits[x / 64] |= (packed_word)1 << (x % 64);
+        }
+    }
+}
+
+
+/* this function writes a packed image into a ONEBIT image of the same
+   size: black where a bit is set and white elsewhere, or the reverse if
+   "black" is false.
+ */
+template<class T>
+void unpack_rows(const packed_image &src, T &dest, bool black = true)
+{
+    typename T::row_iterator row = dest.row_begin();
+    for (size_t y = 0; y < src.nrows(); ++y, ++row) {
+        const packed_word* bits = src.row(y);
+        size_t x = 0;
+        for (typename T::row_iterator::iterator col = row.begin(); col != row.end(); ++col, ++x)
+            *col = ((((bits[x / 64] >> (x % 64)) & 1) != 0) == black) ? 1 : 0;
+    }
+}
+
+
+// ------------- Row Operations ---------------------
+// dest |= the row moved one pixel to the right (to the higher columns)
+inline void or_shifted_right(const packed_word* row, packed_word* dest, size_t words)
+{
+    packed_word carry = 0;
+    for (size_t w = 0; w < words; ++w) {
+        dest[w] |= (row[w] << 1) | carry;
+        carry = row[w] >> 63;
+    }
+}
+
+
+// dest |= the row moved one pixel to the left (to the lower columns)
+inline void or_shifted_left(const packed_word* row, packed_word* dest, size_t words)
+{
+    packed_word carry = 0;
+    for (size_t w = words; w > 0; --w) {
+        dest[w - 1] |= (row[w - 1] >> 1) | carry;
+        carry = row[w - 1] << 63;
+    }
+}
+
+
+/* this function extends the set bits of "seeds" over the runs of "mask"
+   bits that hold them, i.e. it fills the horizontal spans of "mask" that
+   contain a seed. "seeds" must be within "mask".
+ * each word is filled by doubling shifts (six steps per direction), and a
+   span that crosses a word boundary is continued by a carry bit: one pass
+   to the right and one to the left.
+ */
+inline void fill_row_runs(packed_word* seeds, const packed_word* mask, size_t words)
+{
+    packed_word carry = 0;
+    for (size_t w = 0; w < words; ++w) {
+        packed_word p = mask[w];
+        packed_word g = seeds[w] | (carry & p);
+        g |= p & (g << 1);
+        p &= p << 1;
+        g |= p & (g << 2);
+        p &= p << 2;
+        g |= p & (g << 4);
+        p &= p << 4;
+        g |= p & (g << 8);
+        p &= p << 8;
+        g |= p & (g << 16);
+        p &= p << 16;
+        g |= p & (g << 32);
+        seeds[w] = g;
+        carry = g >> 63;
+    }
+    carry = 0;
+    for (size_t w = words; w > 0; --w) {
+        packed_word p = mask[w - 1];
+        packed_word g = seeds[w - 1] | (carry & p);
+        g |= p & (g >> 1);
+        p &= p >> 1;
+        g |= p & (g >> 2);
+        p &= p >> 2;
+        g |= p & (g >> 4);
+        p &= p >> 4;
+        g |= p & (g >> 8);
+        p &= p >> 8;
+        g |= p & (g >> 16);
+        p &= p >> 16;
+        g |= p & (g >> 32);
+        seeds[w - 1] = g;
+        carry = (g & 1) << 63;
+    }
+}
+
+#endif
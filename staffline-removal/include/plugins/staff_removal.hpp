@@ -5,6 +5,8 @@
 #include "gamera.hpp"
 #include "plugins/image_utilities.hpp"
 #include "plugins/projections.hpp"
+#include "packed_rows.hpp"
+#include "packed_morphology.hpp"
 
 #include "math.h"
 #include <vector>
@@ -77,21 +79,6 @@ typename ImageFactory<T>::view_type* directional_med_filter_bw(const T &src, siz
 
 
 // ========================== Staff Removal ====================
-/* this function cheks if there's black pixel within the region
- */
-template<class T>
-bool is_close(const T &src)
-{
-    for (unsigned int m=0; m<src.nrows(); m++) {
-        for (unsigned int n=0; n<src.ncols(); n++) {
-            if (src.get(Point(n, m))!=0)
-                return true;
-        }
-    }
-    return false;
-}
-
-
 /* this function estimates the staff image based on original image and a coarse staff removal result
 
     *neighbour_width*, *neighbour_height*
@@ -105,25 +92,21 @@ typename ImageFactory<T>::view_type* staff_recover(T &src, const T &removal_coar
     // extract coarse staff estimation
     typename ImageFactory<T>::view_type* staff=xor_image(src, removal_coarse, false);
 
-    typename ImageFactory<T>::view_type* local_region=ImageFactory<T>::new_view(removal_coarse);
     size_t half_region_width = region_width / 2;
     size_t half_region_height = region_height / 2;
     // check each staff pixel if it is close enough to non-staff pixel. If so, label it as non-staff pixel
-    for (unsigned int m=0; m<src.nrows(); m++) {
-        for (unsigned int n=0; n<src.ncols(); n++) {
-            if (staff->get(Point(n, m))!=0) {
-                Point ul((coord_t)std::max(0, (int)n - (int)half_region_width),
-                        (coord_t)std::max(0, (int)m - (int)half_region_height));
-                Point lr((coord_t)std::min(n + half_region_width, src.ncols() - 1),
-                        (coord_t)std::min(m + half_region_height, src.nrows() - 1));
-                local_region->rect_set(ul, lr);
-                if (is_close(*local_region))
-                    staff->set(Point(n, m), 0);
-            }
-        }
+    // (the pixels close to non-staff pixels are the non-staff pixels dilated by the region)
+    packed_image staff_bits, coarse;
+    pack_rows(*staff, staff_bits);
+    pack_rows(removal_coarse, coarse);
+    dilate_packed(coarse, half_region_width, half_region_height);
+    for (size_t y = 0; y < staff_bits.nrows(); ++y) {
+        packed_word* bits = staff_bits.row(y);
+        const packed_word* coarse_row = coarse.row(y);
+        for (size_t w = 0; w < staff_bits.words(); ++w)
+            bits[w] &= ~coarse_row[w];
     }
-
-    delete local_region;
+    unpack_rows(staff_bits, *staff);
 
     return staff;
 }